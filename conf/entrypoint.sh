@@ -60,8 +60,24 @@ connection_attempts = 10
 retry_delay = 10
 # in seconds
 
+# Unsent notifications are kept there, and replayed once the broker is back
+spool = ${MQ_SPOOL:-/var/spool/ega/mq.spool}
+
 heartbeat = 0
 
+# Digests of the uploaded files, computed in one pass: sha256, md5, crc32c
+checksums = ${MQ_CHECKSUMS:-sha256}
+
+# Local relay: a few long-lived broker connections, shared by all the sessions
+relay = ${MQ_RELAY:-/run/ega-mq.sock}
+relay_connections = ${MQ_RELAY_CONNECTIONS:-2}
+
+# Publisher confirms: max number of messages waiting for an ack (0 to disable)
+confirm_window = ${MQ_CONFIRM_WINDOW:-128}
+
+# Max number of notifications waiting for the broker, per session
+queue_size = ${MQ_QUEUE_SIZE:-1024}
+
 # Where to send the notifications
 exchange = ${MQ_EXCHANGE:-cega}
 routing_key = ${MQ_ROUTING_KEY:-files.inbox}
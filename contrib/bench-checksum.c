@@ -0,0 +1,123 @@
+/*
+ * Throughput of each SHA-256 implementation that mq-sha256.c can
+ * dispatch to, on this machine.
+ *
+ *   make -C contrib bench-checksum
+ *   ./contrib/bench-checksum [MiB per buffer] [seconds per implementation]
+ *
+ * The implementations are static, so we include the source itself.
+ * Each one hashes the same buffer, over and over, and must agree with
+ * OpenSSL's SHA256() on the result.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
+
+#include "../src/mq-sha256.c"
+
+struct impl {
+  const char* name;
+  sha256_blocks_fn blocks;
+  int (*available)(void);
+};
+
+static int always(void){ return 1; }
+
+static const struct impl impls[] = {
+#ifdef MQ_SHA256_SHANI
+  { "sha-ni",  sha256_blocks_shani,   cpu_has_shani },
+#endif
+  { "openssl", sha256_blocks_openssl, always },
+  { NULL, NULL, NULL }
+};
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Same padding as mq_sha256_final, with a given block function */
+static void
+digest(sha256_blocks_fn blocks, const unsigned char* data, size_t len,
+       unsigned char out[MQ_SHA256_DIGEST_SIZE])
+{
+  uint32_t state[8];
+  size_t nblocks = len / MQ_SHA256_BLOCK_SIZE;
+  unsigned char block[2 * MQ_SHA256_BLOCK_SIZE];
+  size_t rest = len % MQ_SHA256_BLOCK_SIZE;
+  size_t n = (rest < 56)?MQ_SHA256_BLOCK_SIZE:(2 * MQ_SHA256_BLOCK_SIZE);
+  uint64_t bits = (uint64_t)len << 3;
+  int i;
+
+  memcpy(state, sha256_h0, sizeof(state));
+  if(nblocks) blocks(state, data, nblocks);
+
+  memset(block, 0, sizeof(block));
+  memcpy(block, data + nblocks * MQ_SHA256_BLOCK_SIZE, rest);
+  block[rest] = 0x80;
+  for(i = 0; i < 8; i++) block[n - 1 - i] = (unsigned char)(bits >> (8 * i));
+  blocks(state, block, n / MQ_SHA256_BLOCK_SIZE);
+
+  for(i = 0; i < 8; i++){
+    out[4*i    ] = (unsigned char)(state[i] >> 24);
+    out[4*i + 1] = (unsigned char)(state[i] >> 16);
+    out[4*i + 2] = (unsigned char)(state[i] >> 8);
+    out[4*i + 3] = (unsigned char)(state[i]);
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  size_t mib = (argc > 1)?strtoul(argv[1], NULL, 10):1;
+  double secs = (argc > 2)?strtod(argv[2], NULL):2.0;
+  size_t len = mib << 20, i;
+  unsigned char *buf, expected[SHA256_DIGEST_LENGTH], out[MQ_SHA256_DIGEST_SIZE];
+  const struct impl* p;
+  int rc = 0;
+
+  if(!len || secs <= 0){
+    fprintf(stderr, "Usage: %s [MiB per buffer] [seconds per implementation]\n", argv[0]);
+    return 2;
+  }
+  if((buf = malloc(len + 7)) == NULL){ perror("malloc"); return 1; }
+  len += 7; /* a partial last block, to check the padding too */
+  for(i = 0; i < len; i++) buf[i] = (unsigned char)(i * 2654435761u >> 13);
+  SHA256(buf, len, expected);
+
+  printf("dispatched: %s\n", mq_sha256_implementation());
+  printf("%-10s %12s %10s\n", "impl", "bytes", "GB/s");
+
+  for(p = impls; p->name; p++){
+    double start, elapsed;
+    unsigned long long bytes = 0;
+
+    if(!p->available()){
+      printf("%-10s %12s %10s\n", p->name, "-", "n/a");
+      continue;
+    }
+
+    digest(p->blocks, buf, len, out); /* warm up, and check */
+    if(memcmp(out, expected, sizeof(out))){
+      printf("%-10s %12s %10s\n", p->name, "-", "WRONG");
+      rc = 1;
+      continue;
+    }
+
+    start = now();
+    do {
+      digest(p->blocks, buf, len, out);
+      bytes += len;
+    } while((elapsed = now() - start) < secs);
+
+    printf("%-10s %12llu %10.2f\n", p->name, bytes, bytes / elapsed / 1e9);
+  }
+
+  free(buf);
+  return rc;
+}
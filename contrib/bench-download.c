@@ -0,0 +1,218 @@
+/*
+ * Cost of the sftp-server download path, per byte, before and after
+ * read replies were spliced:
+ *
+ *   - "copy":   pread() into read_buf, copied into oqueue after the
+ *               reply header, then written to stdout
+ *   - "splice": spliced from the file into a pipe of our own, then
+ *               to stdout after the reply header
+ *
+ * As in sftp-server, stdout is a blocking pipe. A thread drains it,
+ * as sshd would. The file is read once first, so that it is served
+ * from the page cache. The cycles are the CPU time of the replying
+ * thread only, at the TSC rate (or none without a TSC), so that the
+ * waits for the consumer are left out.
+ *
+ *   make -C contrib bench-download
+ *   ./contrib/bench-download [file MiB] [KiB per read] [passes]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#define HEADER_LEN (4 + 1 + 4 + 4) /* len type id data-len */
+
+static int out[2];      /* "stdout", drained by the consumer */
+static int own[2];      /* the splice pipe of our own */
+static unsigned char *read_buf, *oqueue;
+
+static double
+clock_secs(clockid_t id)
+{
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#define now() clock_secs(CLOCK_MONOTONIC)
+#define cpu() clock_secs(CLOCK_THREAD_CPUTIME_ID)
+
+static uint64_t
+cycles(void)
+{
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void
+put_u32(unsigned char* p, uint32_t v)
+{
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void
+header(unsigned char* p, uint32_t id, uint32_t n)
+{
+  put_u32(p, 1 + 4 + 4 + n);
+  p[4] = 101; /* SSH2_FXP_DATA */
+  put_u32(p + 5, id);
+  put_u32(p + 9, n);
+}
+
+static void
+write_all(int fd, const unsigned char* p, size_t len)
+{
+  ssize_t r;
+
+  while(len){
+    if((r = write(fd, p, len)) == -1){
+      if(errno == EINTR) continue;
+      perror("write"); exit(1);
+    }
+    p += r; len -= r;
+  }
+}
+
+static ssize_t
+reply_copy(int fd, uint32_t id, off_t off, size_t len)
+{
+  ssize_t n = pread(fd, read_buf, len, off);
+
+  if(n <= 0) return n;
+  header(oqueue, id, n);
+  memcpy(oqueue + HEADER_LEN, read_buf, n);
+  write_all(out[1], oqueue, HEADER_LEN + n);
+  return n;
+}
+
+static ssize_t
+reply_splice(int fd, uint32_t id, off_t off, size_t len)
+{
+  loff_t loff = off;
+  ssize_t n = 0, r;
+  unsigned char h[HEADER_LEN];
+  size_t done;
+
+  while((size_t)n < len){
+    r = splice(fd, &loff, own[1], NULL, len - n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(r > 0) n += r;
+    else if(r == 0 || (errno == EAGAIN && n > 0)) break;
+    else if(errno != EINTR){ perror("splice"); exit(1); }
+  }
+  if(n == 0) return 0;
+  header(h, id, n);
+  write_all(out[1], h, sizeof(h));
+  for(done = 0; done < (size_t)n; done += r){
+    r = splice(own[0], NULL, out[1], NULL, n - done, SPLICE_F_MOVE);
+    if(r == -1 && errno == EINTR) r = 0;
+    else if(r <= 0){ perror("splice"); exit(1); }
+  }
+  return n;
+}
+
+static void*
+consumer(void* arg)
+{
+  unsigned char buf[64 * 1024];
+  ssize_t r;
+
+  (void)arg;
+  while((r = read(out[0], buf, sizeof(buf))) != 0)
+    if(r == -1 && errno != EINTR){ perror("read"); exit(1); }
+  return NULL;
+}
+
+static void
+run(const char* name, ssize_t (*reply)(int, uint32_t, off_t, size_t),
+    int fd, off_t size, size_t chunk, int passes)
+{
+  pthread_t t;
+  uint64_t c0, c1;
+  double t0, t1, u0, u1;
+  unsigned long long bytes = 0;
+  uint32_t id = 0;
+  off_t off;
+  ssize_t n;
+  int i;
+
+  if(pipe(out) == -1){ perror("pipe"); exit(1); }
+  fcntl(out[1], F_SETPIPE_SZ, (int)chunk); /* as sshd's, roughly */
+  pthread_create(&t, NULL, consumer, NULL);
+
+  t0 = now();
+  u0 = cpu();
+  c0 = cycles();
+  for(i = 0; i < passes; i++)
+    for(off = 0; off < size; off += n){
+      if((n = reply(fd, id++, off, chunk)) <= 0){
+	fprintf(stderr, "%s: short file\n", name); exit(1);
+      }
+      bytes += n;
+    }
+  c1 = cycles();
+  u1 = cpu();
+  t1 = now();
+
+  close(out[1]);
+  pthread_join(t, NULL);
+  close(out[0]);
+
+  /* CPU seconds, times the cycles per second */
+  printf("%-8s %14llu %12.3f %10.3f %10.2f\n", name, bytes,
+	 (u1 - u0) * (c1 - c0) / (t1 - t0) / bytes,
+	 (u1 - u0) * 1e9 / bytes, bytes / (t1 - t0) / 1e9);
+}
+
+int
+main(int argc, char** argv)
+{
+  size_t mib = (argc > 1)?strtoul(argv[1], NULL, 10):256;
+  size_t chunk = ((argc > 2)?strtoul(argv[2], NULL, 10):256) << 10;
+  int passes = (argc > 3)?atoi(argv[3]):4;
+  char path[] = "/tmp/bench-download.XXXXXX";
+  off_t size = (off_t)mib << 20, off;
+  unsigned char* buf;
+  int fd;
+
+  if(!mib || !chunk || passes <= 0){
+    fprintf(stderr, "Usage: %s [file MiB] [KiB per read] [passes]\n", argv[0]);
+    return 2;
+  }
+  if((fd = mkstemp(path)) == -1){ perror("mkstemp"); return 1; }
+  unlink(path);
+  read_buf = malloc(chunk);
+  oqueue = malloc(HEADER_LEN + chunk);
+  buf = malloc(1 << 20);
+  if(!read_buf || !oqueue || !buf){ perror("malloc"); return 1; }
+  memset(buf, 0xA5, 1 << 20);
+  for(off = 0; off < size; off += 1 << 20) write_all(fd, buf, 1 << 20);
+  fsync(fd);
+  for(off = 0; off < size; off += 1 << 20) pread(fd, buf, 1 << 20, off);
+
+  if(pipe(own) == -1){ perror("pipe"); return 1; }
+  if(fcntl(own[1], F_SETPIPE_SZ, (int)chunk) == -1)
+    fprintf(stderr, "F_SETPIPE_SZ %zu: %s, short splices\n", chunk, strerror(errno));
+
+  printf("%zu MiB file, %zu KiB reads, %d passes\n", mib, chunk >> 10, passes);
+  printf("%-8s %14s %12s %10s %10s\n", "path", "bytes", "cycles/B", "ns/B", "GB/s");
+  run("copy", reply_copy, fd, size, chunk, passes);
+  run("splice", reply_splice, fd, size, chunk, passes);
+
+  close(fd);
+  return 0;
+}
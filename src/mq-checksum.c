@@ -1,22 +1,439 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 
+#include "mq-utils.h"
 #include "mq-checksum.h"
 
+/*
+ * Checksum of the file content, whatever the order of the writes.
+ *
+ * The data written at the end of the hashed prefix is hashed right away.
+ * The writes further ahead (pipelined requests, arriving out of order)
+ * are kept aside, and hashed once the prefix reaches them. When there
+ * are too many of them, or they overlap, they are dropped: the file is
+ * then read back from the end of the prefix, at close.
+ * Only when the prefix itself is overwritten (or truncated) is the whole
+ * file read again.
+ *
+ * All the configured digests are computed over the same data, one
+ * slice at a time, so it is read from memory only once.
+ */
+
+#define MQ_CHECKSUM_READ_SIZE (256 * 1024)
+#define MQ_CHECKSUM_SLICE     (32 * 1024)   /* all the digests go over it while it is in cache */
+
+struct checksum_range_s {
+  uint64_t offset;
+  size_t len;
+  struct checksum_range_s* next;
+  unsigned char data[];
+};
+
+static void
+drop_pending(checksum_t* checksum)
+{
+  struct checksum_range_s* r;
+  while((r = checksum->pending)){
+    checksum->pending = r->next;
+    free(r);
+  }
+  checksum->pending_bytes = 0;
+}
+
+static void
+sha256_update(checksum_t* checksum, const unsigned char* p, size_t dlen)
+{
+  size_t num = checksum->hashed % MQ_SHA256_BLOCK_SIZE;
+  size_t n;
+
+  /* Complete the partial block first */
+  if(num){
+    n = MQ_SHA256_BLOCK_SIZE - num;
+    if(dlen < n){ memcpy(checksum->block + num, p, dlen); return; }
+    memcpy(checksum->block + num, p, n);
+    mq_sha256_blocks(checksum->state, checksum->block, 1);
+    p += n;
+    dlen -= n;
+  }
+
+  /* Then straight from the data */
+  n = dlen / MQ_SHA256_BLOCK_SIZE;
+  mq_sha256_blocks(checksum->state, p, n);
+  p += n * MQ_SHA256_BLOCK_SIZE;
+  memcpy(checksum->block, p, dlen % MQ_SHA256_BLOCK_SIZE);
+}
+
+static void
+extend_prefix(checksum_t* checksum, const void* data, size_t dlen)
+{
+  const unsigned char* p = (const unsigned char*)data;
+  size_t n;
+
+  while(dlen){
+    n = (dlen < MQ_CHECKSUM_SLICE)?dlen:MQ_CHECKSUM_SLICE;
+    if(checksum->types & MQ_CHECKSUM_SHA256) sha256_update(checksum, p, n);
+    if(checksum->types & MQ_CHECKSUM_MD5) MD5_Update(&checksum->md5, p, n);
+    if(checksum->types & MQ_CHECKSUM_CRC32C) checksum->crc32c = mq_crc32c(checksum->crc32c, p, n);
+    checksum->hashed += n;
+    p += n;
+    dlen -= n;
+  }
+}
+
+static void
+reset_digests(checksum_t* checksum)
+{
+  checksum->hashed = 0;
+  mq_sha256_init(checksum->state);
+  MD5_Init(&checksum->md5);
+  checksum->crc32c = 0;
+}
+
+/* ================================================
+ *
+ *                Digest types
+ *
+ * ================================================ */
+
+static const struct {
+  int type;
+  const char* name;
+} checksum_names[] = {
+  { MQ_CHECKSUM_SHA256, "sha256" },
+  { MQ_CHECKSUM_MD5,    "md5"    },
+  { MQ_CHECKSUM_CRC32C, "crc32c" },
+};
+#define CHECKSUM_NAMES (sizeof(checksum_names) / sizeof(checksum_names[0]))
+
+/* From a list like "sha256, md5, crc32c". Returns 0 if none is valid */
+int
+checksum_types(const char* list)
+{
+  const char *p = list, *end;
+  size_t i, len;
+  int types = 0;
+
+  while(p && *p){
+    while(*p == ',' || *p == ' ' || *p == '\t') p++;
+    end = p;
+    while(*end && *end != ',' && *end != ' ' && *end != '\t' && *end != '#') end++;
+    len = end - p;
+    if(!len) break;
+    for(i = 0; i < CHECKSUM_NAMES; i++){
+      if(strlen(checksum_names[i].name) == len && !strncasecmp(p, checksum_names[i].name, len)){
+	types |= checksum_names[i].type;
+	break;
+      }
+    }
+    if(i == CHECKSUM_NAMES) D1("Unknown checksum: %.*s", (int)len, p);
+    if(*end == '#') break; /* comment */
+    p = end;
+  }
+  return types;
+}
+
+const char*
+checksum_type_name(int type)
+{
+  size_t i;
+  for(i = 0; i < CHECKSUM_NAMES; i++)
+    if(checksum_names[i].type == type) return checksum_names[i].name;
+  return NULL;
+}
+
+const unsigned char*
+checksum_digest(const checksum_digests_t* digests, int type, size_t* len)
+{
+  if(!(digests->types & type)) return NULL;
+  switch(type){
+  case MQ_CHECKSUM_SHA256: *len = sizeof(digests->sha256); return digests->sha256;
+  case MQ_CHECKSUM_MD5:    *len = sizeof(digests->md5);    return digests->md5;
+  case MQ_CHECKSUM_CRC32C: *len = sizeof(digests->crc32c); return digests->crc32c;
+  default: return NULL;
+  }
+}
+
+/* ================================================
+ *
+ *                Prefix tracking
+ *
+ * ================================================ */
+
+/* The pending writes reached by the prefix. The parts below it were overwritten since */
+static void
+drain_pending(checksum_t* checksum)
+{
+  struct checksum_range_s* r;
+  uint64_t skip;
+
+  while((r = checksum->pending) && r->offset <= checksum->hashed){
+    skip = checksum->hashed - r->offset;
+    if(skip < r->len)
+      extend_prefix(checksum, r->data + skip, r->len - skip);
+    checksum->pending = r->next;
+    checksum->pending_bytes -= r->len;
+    free(r);
+  }
+}
+
+/* Sorted, and without overlaps. Returns 0 if kept */
+static int
+add_pending(checksum_t* checksum, uint64_t offset, const void* data, size_t dlen)
+{
+  struct checksum_range_s **pp = &checksum->pending, *r;
+
+  if(checksum->pending_bytes + dlen > MQ_CHECKSUM_MAX_PENDING) return 1;
+
+  while(*pp && (*pp)->offset + (*pp)->len <= offset) pp = &(*pp)->next;
+  if(*pp && (*pp)->offset < offset + dlen) return 2; /* overlap */
+
+  r = (struct checksum_range_s*)malloc(sizeof(struct checksum_range_s) + dlen);
+  if(!r) return 3;
+  r->offset = offset;
+  r->len = dlen;
+  memcpy(r->data, data, dlen);
+  r->next = *pp;
+  *pp = r;
+  checksum->pending_bytes += dlen;
+  return 0;
+}
+
+int
+checksum_init(checksum_t* checksum, int types)
+{
+  checksum->types = (types)?types:MQ_CHECKSUM_SHA256;
+  checksum->rehash = 0;
+  checksum->pending = NULL;
+  checksum->pending_bytes = 0;
+  checksum->deferred = 0;
+  reset_digests(checksum);
+  return 1;
+}
+
+int
+checksum_update(checksum_t* checksum, uint64_t offset, const void *data, size_t dlen)
+{
+  if(checksum->rehash || dlen == 0) return 0; /* read back anyway */
+
+  if(offset < checksum->hashed){
+    D2("Overwriting the hashed data at %llu: the file will be read back", (unsigned long long)offset);
+    checksum->rehash = 1;
+    drop_pending(checksum);
+    return 0;
+  }
+
+  if(offset == checksum->hashed){
+    extend_prefix(checksum, data, dlen);
+    drain_pending(checksum);
+    return 0;
+  }
+
+  if(checksum->deferred) return 0; /* read back at the end */
+
+  if(add_pending(checksum, offset, data, dlen)){
+    D3("Deferring the data after %llu to the close", (unsigned long long)checksum->hashed);
+    drop_pending(checksum);
+    checksum->deferred = 1; /* no more copies, for nothing */
+  }
+  return 0;
+}
+
+void
+checksum_truncate(checksum_t* checksum, uint64_t size)
+{
+  if(size < checksum->hashed) checksum->rehash = 1;
+  drop_pending(checksum); /* might be cut */
+}
+
+/* Reads back what is not hashed yet, from fd (which must be readable). Usually nothing */
+static int
+complete_prefix(checksum_t* checksum, int fd, struct stat* st)
+{
+  unsigned char* buf = NULL;
+  ssize_t n;
+  int rc = 0;
+
+  drop_pending(checksum);
+
+  if(fstat(fd, st) != 0){
+    D1("Could not stat the file: %s", strerror(errno));
+    return 1;
+  }
+  if((uint64_t)st->st_size < checksum->hashed) checksum->rehash = 1; /* truncated */
+
+  if(checksum->rehash){
+    reset_digests(checksum);
+    checksum->rehash = 0;
+    D2("Reading back the whole file");
+  }
+
+  while((uint64_t)st->st_size > checksum->hashed){
+    if(!buf && !(buf = malloc(MQ_CHECKSUM_READ_SIZE))){ rc = 2; break; }
+    n = pread(fd, buf, MQ_CHECKSUM_READ_SIZE, checksum->hashed);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0){ D1("Could not read back the file: %s", strerror(errno)); rc = 3; break; }
+    if(n == 0) break;
+    extend_prefix(checksum, buf, n);
+  }
+  free(buf);
+  return rc;
+}
+
+/* ================================================
+ *
+ *                Saved states
+ *
+ * The state is saved along the file, in an extended attribute,
+ * when an upload is closed or interrupted. When the file is opened
+ * again for writing (to resume the upload), and it did not change
+ * since, the state is restored: only the new data is then hashed.
+ *
+ * The raw states are saved: they are only read back by the same build.
+ *
+ * ================================================ */
+
+#define MQ_CHECKSUM_XATTR "user.ega.checksum"
+#define MQ_CHECKSUM_MAGIC "EGACKS01"
+
+struct checksum_saved_s {
+  char magic[8];
+  int32_t types;
+  uint64_t hashed;                  /* the whole file */
+  uint64_t ino;
+  int64_t mtime;
+  int64_t mtime_nsec;
+  uint32_t state[8];
+  unsigned char block[MQ_SHA256_BLOCK_SIZE];
+  MD5_CTX md5;
+  uint32_t crc32c;
+};
+
+static void
+save_state(const checksum_t* checksum, int fd, const struct stat* st)
+{
+  struct checksum_saved_s saved;
+
+  if((uint64_t)st->st_size != checksum->hashed) return; /* incomplete */
+
+  memset(&saved, 0, sizeof(saved));
+  memcpy(saved.magic, MQ_CHECKSUM_MAGIC, sizeof(saved.magic));
+  saved.types = checksum->types;
+  saved.hashed = checksum->hashed;
+  saved.ino = st->st_ino;
+  saved.mtime = st->st_mtim.tv_sec;
+  saved.mtime_nsec = st->st_mtim.tv_nsec;
+  memcpy(saved.state, checksum->state, sizeof(saved.state));
+  memcpy(saved.block, checksum->block, sizeof(saved.block));
+  saved.md5 = checksum->md5;
+  saved.crc32c = checksum->crc32c;
+
+  if(fsetxattr(fd, MQ_CHECKSUM_XATTR, &saved, sizeof(saved), 0) != 0)
+    D2("Could not save the checksum state: %s", strerror(errno));
+  else
+    D3("Checksum state saved at %llu bytes", (unsigned long long)saved.hashed);
+}
+
+/* When an upload is resumed. Returns 0 if restored */
+int
+checksum_restore(checksum_t* checksum, int fd)
+{
+  struct checksum_saved_s saved;
+  struct stat st;
+
+  if(fgetxattr(fd, MQ_CHECKSUM_XATTR, &saved, sizeof(saved)) != sizeof(saved) ||
+     memcmp(saved.magic, MQ_CHECKSUM_MAGIC, sizeof(saved.magic)))
+    return 1;
+
+  if(fstat(fd, &st) != 0 ||
+     saved.types != checksum->types ||
+     saved.hashed != (uint64_t)st.st_size ||
+     saved.ino != (uint64_t)st.st_ino ||
+     saved.mtime != (int64_t)st.st_mtim.tv_sec ||
+     saved.mtime_nsec != (int64_t)st.st_mtim.tv_nsec){
+    D2("Stale checksum state: ignored");
+    return 2;
+  }
+
+  drop_pending(checksum);
+  checksum->rehash = 0;
+  checksum->hashed = saved.hashed;
+  memcpy(checksum->state, saved.state, sizeof(saved.state));
+  memcpy(checksum->block, saved.block, sizeof(saved.block));
+  checksum->md5 = saved.md5;
+  checksum->crc32c = saved.crc32c;
+  D2("Checksum state restored at %llu bytes", (unsigned long long)saved.hashed);
+  return 0;
+}
+
+/* For an interrupted upload */
 int
-checksum_init(checksum_t* checksum)
+checksum_save(checksum_t* checksum, int fd)
+{
+  struct stat st;
+  int rc = complete_prefix(checksum, fd, &st);
+  if(!rc) save_state(checksum, fd, &st);
+  return rc;
+}
+
+static void
+final_digests(checksum_t* checksum, checksum_digests_t* out)
 {
-  return SHA256_Init(checksum);
+  out->types = checksum->types;
+  if(checksum->types & MQ_CHECKSUM_SHA256)
+    mq_sha256_final(checksum->state, checksum->block, checksum->hashed % MQ_SHA256_BLOCK_SIZE,
+		    checksum->hashed, out->sha256);
+  if(checksum->types & MQ_CHECKSUM_MD5)
+    MD5_Final(out->md5, &checksum->md5);
+  if(checksum->types & MQ_CHECKSUM_CRC32C){
+    out->crc32c[0] = (unsigned char)(checksum->crc32c >> 24);
+    out->crc32c[1] = (unsigned char)(checksum->crc32c >> 16);
+    out->crc32c[2] = (unsigned char)(checksum->crc32c >> 8);
+    out->crc32c[3] = (unsigned char)(checksum->crc32c);
+  }
 }
 
 int
-checksum_add(checksum_t* checksum, const void *data, size_t dlen)
+checksum_final(checksum_t* checksum, int fd, checksum_digests_t* out)
 {
-  return SHA256_Update(checksum, data, dlen);
+  struct stat st;
+  int rc = complete_prefix(checksum, fd, &st);
+
+  D2("Checksum over %llu bytes", (unsigned long long)checksum->hashed);
+  if(!rc) save_state(checksum, fd, &st); /* before the digests consume it */
+  final_digests(checksum, out);
+  if(rc) out->types = 0; /* a partial digest is a wrong one */
+  return rc;
 }
 
+/*
+ * The digests of a whole file, for the clients checking it: from the
+ * state saved at the end of its upload, if still valid, otherwise by
+ * reading it. Nothing is saved.
+ */
 int
-checksum_final(checksum_t* checksum,
-	       unsigned char out[MQ_CHECKSUM_SIZE])
+checksum_file(int fd, int types, checksum_digests_t* out)
+{
+  checksum_t checksum;
+  struct stat st;
+  int rc;
+
+  checksum_init(&checksum, types);
+  checksum_restore(&checksum, fd); /* from the start, if not restored */
+  rc = complete_prefix(&checksum, fd, &st);
+  D2("Checksum over %llu bytes", (unsigned long long)checksum.hashed);
+  if(!rc) final_digests(&checksum, out);
+  checksum_clean(&checksum);
+  return rc;
+}
+
+void
+checksum_clean(checksum_t* checksum)
 {
-  return SHA256_Final(out, checksum);
+  drop_pending(checksum);
 }
@@ -1,21 +1,67 @@
 #ifndef __MQ_CHECKSUM_H_INCLUDED__
 #define __MQ_CHECKSUM_H_INCLUDED__
 
-#include <openssl/sha.h>
+#include <stdint.h>
+#include <sys/types.h>
 
-#define MQ_CHECKSUM_TYPE "sha256"
-#define MQ_CHECKSUM_SIZE SHA256_DIGEST_LENGTH
+#include <openssl/md5.h>
 
-typedef SHA256_CTX checksum_t;
+#include "mq-sha256.h"
+#include "mq-crc32c.h"
 
-int checksum_init(checksum_t* checksum);
+/* Digest algorithms, as a mask. Computed in one pass, and listed in that order */
+#define MQ_CHECKSUM_SHA256 0x1
+#define MQ_CHECKSUM_MD5    0x2
+#define MQ_CHECKSUM_CRC32C 0x4
+#define MQ_CHECKSUM_ALL    (MQ_CHECKSUM_SHA256 | MQ_CHECKSUM_MD5 | MQ_CHECKSUM_CRC32C)
 
-int checksum_add(checksum_t* checksum, const void *data, size_t dlen);
+#define MQ_CHECKSUM_MAX_SIZE MQ_SHA256_DIGEST_SIZE
 
-int checksum_final(checksum_t* checksum, unsigned char out[MQ_CHECKSUM_SIZE]);
+/* Max bytes kept aside per file, for the writes ahead of the hashed prefix */
+#define MQ_CHECKSUM_MAX_PENDING (8 * 1024 * 1024)
 
-#endif /* !__MQ_CHECKSUM_H_INCLUDED__ */
+struct checksum_range_s;
+
+/* No pointers in the hash states: they can be copied as is */
+struct checksum_s {
+  int types;                         /* the digests to compute */
+  uint32_t state[8];                 /* SHA-256 chaining value */
+  unsigned char block[MQ_SHA256_BLOCK_SIZE]; /* the last, partial, block: hashed % 64 bytes */
+  MD5_CTX md5;
+  uint32_t crc32c;
+  uint64_t hashed;                   /* contiguous prefix already hashed */
+  int rehash;                        /* the prefix was overwritten: hash it all again at the end */
+  struct checksum_range_s* pending;  /* out-of-order writes, sorted by offset */
+  size_t pending_bytes;
+  int deferred;                      /* pending gave up once: the rest past the prefix is read back */
+};
+typedef struct checksum_s checksum_t;
+
+struct checksum_digests_s {
+  int types;                         /* the ones set */
+  unsigned char sha256[MQ_SHA256_DIGEST_SIZE];
+  unsigned char md5[MD5_DIGEST_LENGTH];
+  unsigned char crc32c[MQ_CRC32C_DIGEST_SIZE];  /* big-endian */
+};
+typedef struct checksum_digests_s checksum_digests_t;
+
+int checksum_types(const char* list);
+const char* checksum_type_name(int type);
+const unsigned char* checksum_digest(const checksum_digests_t* digests, int type, size_t* len);
+
+int checksum_init(checksum_t* checksum, int types);
 
+int checksum_update(checksum_t* checksum, uint64_t offset, const void *data, size_t dlen);
 
+void checksum_truncate(checksum_t* checksum, uint64_t size);
 
+int checksum_final(checksum_t* checksum, int fd, checksum_digests_t* out);
 
+int checksum_save(checksum_t* checksum, int fd);
+int checksum_restore(checksum_t* checksum, int fd);
+
+int checksum_file(int fd, int types, checksum_digests_t* out);
+
+void checksum_clean(checksum_t* checksum);
+
+#endif /* !__MQ_CHECKSUM_H_INCLUDED__ */
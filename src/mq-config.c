@@ -13,12 +13,21 @@
 #include "mq-utils.h"
 #include "mq-config.h"
 #include "mq-notify.h"
+#include "mq-spool.h"
+#include "mq-relay.h"
+#include "mq-checksum.h"
 
 /* Default values */
 #define MQ_HEARTBEAT       0
 #define MQ_ENABLE_SSL      false
 #define MQ_VERIFY_PEER     0
 #define MQ_VERIFY_HOSTNAME 0
+#define MQ_QUEUE_SIZE      1024
+#define MQ_CONNECTION_ATTEMPTS 1
+#define MQ_RETRY_DELAY     10
+#define MQ_CONFIRM_WINDOW  128
+#define MQ_RELAY_CONNECTIONS 2
+#define MQ_CHECKSUMS       MQ_CHECKSUM_SHA256
 
 /* global variable for the MQ connection settings */
 mq_options_t* mq_options = NULL;
@@ -34,6 +43,8 @@ clean_mq_config(void)
   if(!mq_options) return;
 
   mq_clean(); /* Cleaning MQ connection */
+  mq_spool_close();
+  mq_relay_disconnect();
 
   D2("Cleaning configuration [%p]", mq_options);
   if(mq_options->buffer){ free((char*)mq_options->buffer); }
@@ -52,6 +63,12 @@ valid_options(void)
   D2("Checking the config struct");
   if(mq_options->heartbeat < 0    ) { D3("Invalid heartbeat");           valid = false; }
   if(mq_options->port < 0         ) { D3("Invalid port");                valid = false; }
+  if(mq_options->queue_size <= 0  ) { D3("Invalid queue_size");          valid = false; }
+  if(mq_options->connection_attempts <= 0) { D3("Invalid connection_attempts"); valid = false; }
+  if(mq_options->retry_delay < 0  ) { D3("Invalid retry_delay");         valid = false; }
+  if(mq_options->confirm_window < 0) { D3("Invalid confirm_window");     valid = false; }
+  if(mq_options->relay_connections <= 0) { D3("Invalid relay_connections"); valid = false; }
+  if(!mq_options->checksums       ) { D3("No checksum algorithm");       valid = false; }
 
   if(!mq_options->dsn             ) { D3("Missing dsn connection");      valid = false; }
 
@@ -98,6 +115,14 @@ readconfig(FILE* fp, const char* cfgfile, char* buffer, size_t buflen)
 
   /* Default config values */
   mq_options->heartbeat = MQ_HEARTBEAT;
+  mq_options->queue_size = MQ_QUEUE_SIZE;
+  mq_options->connection_attempts = MQ_CONNECTION_ATTEMPTS;
+  mq_options->retry_delay = MQ_RETRY_DELAY;
+  mq_options->confirm_window = MQ_CONFIRM_WINDOW;
+  mq_options->spool = NULL;
+  mq_options->relay = NULL;
+  mq_options->relay_connections = MQ_RELAY_CONNECTIONS;
+  mq_options->checksums = MQ_CHECKSUMS;
   mq_options->connection_opened = 0; /* not opened yet */
   mq_options->ssl = MQ_ENABLE_SSL;
   mq_options->verify_peer = MQ_VERIFY_PEER;
@@ -141,10 +166,18 @@ readconfig(FILE* fp, const char* cfgfile, char* buffer, size_t buflen)
     INJECT_OPTION(key, "routing_key"   , val, &(mq_options->routing_key) );
     INJECT_OPTION(key, "connection"    , val, &(mq_options->dsn)         );
     INJECT_OPTION(key, "cacert"        , val, &(mq_options->cacert)      );
+    INJECT_OPTION(key, "spool"         , val, &(mq_options->spool)       );
+    INJECT_OPTION(key, "relay"         , val, &(mq_options->relay)       );
 
     /* strtol ok even when val contains a comment #... */
     if(!strcmp(key, "heartbeat"           )) { mq_options->heartbeat   = strtol(val, NULL, 10); }
     if(!strcmp(key, "port"                )) { mq_options->port        = strtol(val, NULL, 10); }
+    if(!strcmp(key, "queue_size"          )) { mq_options->queue_size  = strtol(val, NULL, 10); }
+    if(!strcmp(key, "connection_attempts" )) { mq_options->connection_attempts = strtol(val, NULL, 10); }
+    if(!strcmp(key, "retry_delay"         )) { mq_options->retry_delay = strtol(val, NULL, 10); }
+    if(!strcmp(key, "confirm_window"      )) { mq_options->confirm_window = strtol(val, NULL, 10); }
+    if(!strcmp(key, "relay_connections"   )) { mq_options->relay_connections = strtol(val, NULL, 10); }
+    if(!strcmp(key, "checksums"           )) { mq_options->checksums = checksum_types(val); }
 
     /* Yes/No options */
     set_yes_no_option(key, val, "enable_ssl", &(mq_options->ssl));
@@ -152,6 +185,13 @@ readconfig(FILE* fp, const char* cfgfile, char* buffer, size_t buflen)
     set_yes_no_option(key, val, "verify_hostname", &(mq_options->verify_hostname));
   }
 
+  if(mq_options->queue_size <= 0) mq_options->queue_size = MQ_QUEUE_SIZE;
+  if(mq_options->connection_attempts <= 0) mq_options->connection_attempts = MQ_CONNECTION_ATTEMPTS;
+  if(mq_options->retry_delay < 0) mq_options->retry_delay = MQ_RETRY_DELAY;
+  if(mq_options->confirm_window < 0) mq_options->confirm_window = MQ_CONFIRM_WINDOW;
+  if(mq_options->relay_connections <= 0) mq_options->relay_connections = MQ_RELAY_CONNECTIONS;
+  if(!mq_options->checksums) mq_options->checksums = MQ_CHECKSUMS;
+
   D3("Initializing MQ connection/socket early");
   
   int rc = 0;
@@ -193,6 +233,8 @@ load_mq_config(char* cfgfile)
   mq_options->buffer = NULL;
   mq_options->conn = NULL;
   mq_options->socket = NULL;
+  mq_options->spool_fd = -1;
+  mq_options->relay_fd = -1;
 
 REALLOC:
   D3("Allocating buffer of size %zd", size);
@@ -213,6 +255,14 @@ REALLOC:
     goto REALLOC;
   }
 
+  /* Opened before chroot, once the buffer is big enough */
+  if(mq_options->spool && mq_spool_open(mq_options->spool) != 0){
+    D1("Could not use the spool %s: unsent notifications will be lost", mq_options->spool);
+  }
+
+  /* Nobody listens yet, in the sshd listener itself */
+  mq_relay_connect();
+
   D3("Conf loaded [@ %p]", mq_options);
 
 #ifdef DEBUG
@@ -222,6 +272,45 @@ REALLOC:
 #endif
 }
 
+static int
+preserve_fd(int* fd, int lowfd)
+{
+  if(*fd < 0) return lowfd;
+
+  if(*fd != lowfd){
+    if(dup2(*fd, lowfd) < 0){
+      D1("Could not keep descriptor %d open: %s", *fd, strerror(errno));
+      *fd = -1;
+      return lowfd;
+    }
+    close(*fd);
+    *fd = lowfd;
+  }
+  return lowfd + 1;
+}
+
+/*
+ * For the session children, before they close their descriptors
+ * and drop privileges: the MQ descriptors are moved right after lowfd.
+ * Lowest first, so that none is overwritten by another.
+ * Returns the first descriptor that can be closed.
+ */
+int
+mq_preserve_fds(int lowfd)
+{
+  int *first, *second;
+
+  if(!mq_options) return lowfd;
+
+  if(mq_options->spool_fd < mq_options->relay_fd){
+    first = &mq_options->spool_fd; second = &mq_options->relay_fd;
+  } else {
+    first = &mq_options->relay_fd; second = &mq_options->spool_fd;
+  }
+  lowfd = preserve_fd(first, lowfd);
+  return preserve_fd(second, lowfd);
+}
+
 /* Must be called after dsn_parse() */
 static int
 convert_host_to_ip(char** buffer, size_t* buflen)
@@ -35,6 +35,22 @@ struct mq_options_s {
   char* routing_key;   /* Routing key to send to */
 
   int heartbeat;       /* in seconds */
+
+  int queue_size;      /* max number of pending events in the publisher queue */
+
+  int confirm_window;  /* messages published before waiting for the broker acks (0: no confirms) */
+
+  int checksums;       /* digests of the uploaded files (mask of MQ_CHECKSUM_*) */
+
+  int connection_attempts; /* before giving up (or spooling) */
+  int retry_delay;         /* in seconds */
+
+  char* spool;         /* path to the spool of unsent notifications */
+  int spool_fd;        /* opened before chroot */
+
+  char* relay;             /* path to the local relay socket (none: direct connections) */
+  int relay_connections;   /* relay workers, each with its own broker connection */
+  int relay_fd;            /* connected before chroot */
 };
 
 typedef struct mq_options_s mq_options_t;
@@ -44,6 +60,8 @@ extern mq_options_t* mq_options;
 bool load_mq_config(char* cfgfile);
 void clean_mq_config(void);
 
+int mq_preserve_fds(int lowfd);
+
 #endif /* !__MQ_CONFIG_H_INCLUDED__ */
 
 
@@ -0,0 +1,153 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "mq-utils.h"
+#include "mq-crc32c.h"
+
+/*
+ * CRC-32C (Castagnoli), dispatched once at runtime:
+ *
+ *   - "sse4.2": the crc32 instruction, 8 bytes at a time
+ *   - "table":  slicing-by-8, with tables built on first use
+ */
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MQ_CRC32C_SSE42 1
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reflected */
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char* p, size_t len);
+
+/* ================================================
+ *
+ *                Tables
+ *
+ * ================================================ */
+
+static uint32_t crc32c_table[8][256];
+
+static void
+crc32c_init_tables(void)
+{
+  uint32_t crc;
+  int i, j;
+
+  for(i = 0; i < 256; i++){
+    crc = i;
+    for(j = 0; j < 8; j++) crc = (crc >> 1) ^ ((crc & 1)?CRC32C_POLY:0);
+    crc32c_table[0][i] = crc;
+  }
+  for(i = 0; i < 256; i++){
+    crc = crc32c_table[0][i];
+    for(j = 1; j < 8; j++){
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[j][i] = crc;
+    }
+  }
+}
+
+static uint32_t
+crc32c_table_update(uint32_t crc, const unsigned char* p, size_t len)
+{
+  uint64_t w;
+
+  while(len && ((uintptr_t)p & 7)){ crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8); len--; }
+
+  while(len >= 8){
+    memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    w ^= crc;
+    crc = crc32c_table[7][ w        & 0xff] ^ crc32c_table[6][(w >>  8) & 0xff] ^
+          crc32c_table[5][(w >> 16) & 0xff] ^ crc32c_table[4][(w >> 24) & 0xff] ^
+          crc32c_table[3][(w >> 32) & 0xff] ^ crc32c_table[2][(w >> 40) & 0xff] ^
+          crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][ w >> 56        ];
+    p += 8;
+    len -= 8;
+  }
+
+  while(len--) crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+/* ================================================
+ *
+ *                SSE 4.2
+ *
+ * ================================================ */
+
+#ifdef MQ_CRC32C_SSE42
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42_update(uint32_t crc, const unsigned char* p, size_t len)
+{
+  uint64_t c = crc, w;
+
+  while(len && ((uintptr_t)p & 7)){ c = _mm_crc32_u8((uint32_t)c, *p++); len--; }
+  while(len >= 8){
+    memcpy(&w, p, 8);
+    c = _mm_crc32_u64(c, w);
+    p += 8;
+    len -= 8;
+  }
+  while(len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+  return (uint32_t)c;
+}
+
+static int
+cpu_has_sse42(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+  return (ecx & bit_SSE4_2) != 0;
+}
+#endif /* !MQ_CRC32C_SSE42 */
+
+/* ================================================
+ *
+ *                Dispatch
+ *
+ * ================================================ */
+
+static crc32c_fn crc32c_update = NULL;
+static const char* crc32c_name = NULL;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32c_select(void)
+{
+#ifdef MQ_CRC32C_SSE42
+  if(cpu_has_sse42()){
+    crc32c_update = crc32c_sse42_update;
+    crc32c_name = "sse4.2";
+    goto final;
+  }
+#endif
+  crc32c_init_tables();
+  crc32c_update = crc32c_table_update;
+  crc32c_name = "table";
+
+#ifdef MQ_CRC32C_SSE42
+final:
+#endif
+  D2("CRC-32C implementation: %s", crc32c_name);
+}
+
+const char*
+mq_crc32c_implementation(void)
+{
+  pthread_once(&crc32c_once, crc32c_select);
+  return crc32c_name;
+}
+
+uint32_t
+mq_crc32c(uint32_t crc, const void* data, size_t len)
+{
+  pthread_once(&crc32c_once, crc32c_select);
+  return ~crc32c_update(~crc, (const unsigned char*)data, len);
+}
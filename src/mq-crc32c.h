@@ -0,0 +1,14 @@
+#ifndef __MQ_CRC32C_H_INCLUDED__
+#define __MQ_CRC32C_H_INCLUDED__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MQ_CRC32C_DIGEST_SIZE 4
+
+/* Like zlib's crc32(): start with 0, and chain the returned values */
+uint32_t mq_crc32c(uint32_t crc, const void* data, size_t len);
+
+const char* mq_crc32c_implementation(void);
+
+#endif /* !__MQ_CRC32C_H_INCLUDED__ */
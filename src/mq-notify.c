@@ -1,11 +1,11 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 
-/* For JSON */
-#include <json-c/json.h>
-
 /* For uuid in the MQ message */
 #include <uuid/uuid.h>
 #define UUID_STR_LEN	37
@@ -19,16 +19,39 @@
 #include "mq-config.h"
 #include "mq-notify.h"
 #include "mq-checksum.h"
+#include "mq-spool.h"
+#include "mq-relay.h"
 
 static int do_send_message(const char* message);
 static char* build_message(int operation,
 	      const char* username,
 	      const char* filepath,
-	      const unsigned char *digest,
+	      const checksum_digests_t *digests,
 	      const off_t filesize,
 	      const time_t modified,
 	      const char* oldpath);
 
+/*
+ * Compact event, as queued by the SFTP handlers.
+ * The strings are allocated in the same block, right after the struct.
+ */
+struct mq_event_s {
+  int operation;
+  char* username;
+  char* filepath;
+  char* oldpath;                 /* only for rename */
+  checksum_digests_t digests;
+  off_t filesize;
+  time_t modified;
+};
+typedef struct mq_event_s mq_event_t;
+
+static int mq_enqueue(mq_event_t* ev);
+static void mq_stop_publisher(void);
+
+static uint64_t mq_delivery_tag = 0; /* last one used, with publisher confirms */
+static void mq_fail_inflight(void);
+
 /* ================================================
  *
  *              Broker connection
@@ -49,22 +72,27 @@ mq_init(void)
 int
 mq_clean(void)
 {
+  mq_stop_publisher(); /* flush the pending events first */
+
   if(!mq_options->conn) return 0; /* Not initialized */
 
   D2("Cleaning connection to message broker");
   amqp_rpc_reply_t amqp_ret;
   int rc;
 
-  amqp_ret = amqp_channel_close(mq_options->conn, 1, AMQP_REPLY_SUCCESS);
-  if (amqp_ret.reply_type != AMQP_RESPONSE_NORMAL) {
-    D2("Error: Closing channel");
-    return 1;
-  }
+  if(mq_options->connection_opened){ /* else, nothing to close */
 
-  amqp_ret = amqp_connection_close(mq_options->conn, AMQP_REPLY_SUCCESS);
-  if (amqp_ret.reply_type != AMQP_RESPONSE_NORMAL) {
-    D2("Error: Closing connection");
-    return 2;
+    amqp_ret = amqp_channel_close(mq_options->conn, 1, AMQP_REPLY_SUCCESS);
+    if (amqp_ret.reply_type != AMQP_RESPONSE_NORMAL) {
+      D2("Error: Closing channel");
+      return 1;
+    }
+
+    amqp_ret = amqp_connection_close(mq_options->conn, AMQP_REPLY_SUCCESS);
+    if (amqp_ret.reply_type != AMQP_RESPONSE_NORMAL) {
+      D2("Error: Closing connection");
+      return 2;
+    }
   }
 
   /* check if ssl */
@@ -80,6 +108,7 @@ mq_clean(void)
 
   mq_options->connection_opened = 0;
   mq_options->conn = NULL;
+  mq_options->socket = NULL; /* freed with the connection */
   return 0;
 }
 
@@ -148,11 +177,511 @@ mq_open_connection(void)
     return 4;
   }
 
+  if(mq_options->confirm_window > 0){
+    amqp_confirm_select(mq_options->conn, 1);
+    amqp_ret = amqp_get_rpc_reply(mq_options->conn);
+    if (amqp_ret.reply_type != AMQP_RESPONSE_NORMAL) {
+      D2("Error enabling publisher confirms");
+      return 5;
+    }
+    mq_delivery_tag = 0; /* Tags restart at 1 on a new channel */
+  }
+
   /* Success: Mark it as opened */
   mq_options->connection_opened = 1;
   return 0;
 }
 
+/*
+ * Drop a broken connection and prepare a fresh socket.
+ * Note: with verify_peer, the cacert is re-read, so it must be
+ * reachable from the chroot for the reconnection to succeed.
+ */
+static int
+mq_reset_connection(void)
+{
+  D2("Resetting the connection to the message broker");
+  mq_fail_inflight();
+  if(mq_options->conn) amqp_destroy_connection(mq_options->conn);
+  mq_options->conn = NULL;
+  mq_options->socket = NULL;
+  mq_options->connection_opened = 0;
+  return mq_init();
+}
+
+static time_t mq_last_attempt = 0;
+static int mq_connection_broken = 0;
+
+/*
+ * With a spool, we try once, and not again before retry_delay:
+ * the events are spooled in the meantime.
+ * Without, we try connection_attempts times, retry_delay apart.
+ */
+static int
+mq_connect(void)
+{
+  int i, attempts;
+
+  if(mq_options->connection_opened) return 0;
+
+  /* Cleaned, and used again */
+  if(!mq_options->conn && mq_init() != 0) return 1;
+
+  if(mq_options->spool_fd >= 0 && mq_last_attempt &&
+     time(NULL) - mq_last_attempt < mq_options->retry_delay)
+    return 1; /* too soon */
+
+  attempts = (mq_options->spool_fd >= 0)?1:mq_options->connection_attempts;
+  for(i = 0; i < attempts; i++){
+    if(i){
+      D2("Retrying in %d seconds", mq_options->retry_delay);
+      sleep(mq_options->retry_delay);
+    }
+    mq_last_attempt = time(NULL);
+    if(mq_connection_broken && mq_reset_connection() != 0) continue;
+    if(mq_open_connection() == 0){ mq_connection_broken = 0; return 0; }
+    mq_connection_broken = 1;
+  }
+  D1("Unable to connect to amqp%s://%s:%d/%s", ((mq_options->ssl)?"s":""),
+                                               mq_options->host,
+                                               mq_options->port,
+	                                       mq_options->vhost);
+  return 2;
+}
+
+/* ================================================
+ *
+ *              Publisher confirms
+ *
+ * The channel is put in confirm mode, and up to confirm_window
+ * messages are published before waiting for the broker acks.
+ * The acks are read in between publications, without blocking,
+ * and all of them are waited for at the end of a batch.
+ *
+ * The new messages that are nacked, or lost with the connection,
+ * are collected in mq_unconfirmed, to be spooled. The replayed ones
+ * have no copy here: they stay in the spool, and are replayed again.
+ *
+ * ================================================ */
+
+#define MQ_CONFIRM_TIMEOUT 30 /* seconds, before we consider the connection lost */
+
+#define MQ_INFLIGHT_PENDING 0
+#define MQ_INFLIGHT_ACKED   1
+#define MQ_INFLIGHT_NACKED  2
+
+struct mq_inflight_s {
+  uint64_t tag;
+  char* message; /* owned, or NULL when replayed from the spool */
+  int state;
+};
+
+static struct mq_inflight_s* mq_inflight = NULL; /* ring, by tag order */
+static size_t mq_inflight_head = 0;
+static size_t mq_inflight_count = 0;
+
+static char** mq_unconfirmed = NULL;
+static size_t mq_unconfirmed_count = 0;
+static size_t mq_unconfirmed_size = 0;
+
+static int mq_replay_failed = 0;
+
+/* Takes ownership of message */
+static void
+mq_add_unconfirmed(char* message)
+{
+  if(mq_unconfirmed_count == mq_unconfirmed_size){
+    size_t size = (mq_unconfirmed_size)?(mq_unconfirmed_size << 1):64;
+    char** tmp = (char**)realloc(mq_unconfirmed, size * sizeof(char*));
+    if(!tmp){ D1("Could not keep an unconfirmed message: it is lost"); free(message); return; }
+    mq_unconfirmed = tmp;
+    mq_unconfirmed_size = size;
+  }
+  mq_unconfirmed[mq_unconfirmed_count++] = message;
+}
+
+static void
+mq_settle(struct mq_inflight_s* e)
+{
+  if(e->state == MQ_INFLIGHT_ACKED){
+    free(e->message);
+  } else if(e->message){
+    mq_add_unconfirmed(e->message);
+  } else {
+    mq_replay_failed = 1;
+  }
+  e->message = NULL;
+}
+
+/* Pop the settled ones, in tag order */
+static void
+mq_pop_settled(void)
+{
+  while(mq_inflight_count > 0 && mq_inflight[mq_inflight_head].state != MQ_INFLIGHT_PENDING){
+    mq_settle(&mq_inflight[mq_inflight_head]);
+    mq_inflight_head = (mq_inflight_head + 1) % mq_options->confirm_window;
+    mq_inflight_count--;
+  }
+}
+
+static void
+mq_confirm(uint64_t tag, int multiple, int state)
+{
+  size_t i;
+  D3("%s for tag %llu%s", (state == MQ_INFLIGHT_ACKED)?"Ack":"Nack",
+     (unsigned long long)tag, (multiple)?" (multiple)":"");
+  for(i = 0; i < mq_inflight_count; i++){
+    struct mq_inflight_s* e = &mq_inflight[(mq_inflight_head + i) % mq_options->confirm_window];
+    if(e->tag > tag) break;
+    if(e->tag == tag || multiple) e->state = state;
+  }
+  mq_pop_settled();
+}
+
+/* The connection is gone: nothing in flight will be confirmed */
+static void
+mq_fail_inflight(void)
+{
+  size_t i;
+  for(i = 0; i < mq_inflight_count; i++){
+    struct mq_inflight_s* e = &mq_inflight[(mq_inflight_head + i) % mq_options->confirm_window];
+    if(e->state == MQ_INFLIGHT_PENDING) e->state = MQ_INFLIGHT_NACKED;
+  }
+  mq_pop_settled();
+}
+
+static void
+mq_broken_connection(void)
+{
+  mq_options->connection_opened = 0;
+  mq_connection_broken = 1;
+  mq_fail_inflight();
+}
+
+/*
+ * Read the acks/nacks until at most 'limit' messages are in flight.
+ * With block == 0, only reads what is already there.
+ */
+static int
+mq_wait_confirms(size_t limit, int block)
+{
+  amqp_frame_t frame;
+  struct timeval tv;
+  int rc;
+
+  while(mq_inflight_count > limit){
+    tv.tv_sec = (block)?MQ_CONFIRM_TIMEOUT:0;
+    tv.tv_usec = 0;
+    rc = amqp_simple_wait_frame_noblock(mq_options->conn, &frame, &tv);
+
+    if(rc == AMQP_STATUS_TIMEOUT && !block) return 0;
+    if(rc != AMQP_STATUS_OK){
+      D1("Error waiting for the publisher confirms: %s", amqp_error_string2(rc));
+      mq_broken_connection();
+      return 1;
+    }
+    if(frame.frame_type != AMQP_FRAME_METHOD) continue;
+
+    switch(frame.payload.method.id){
+    case AMQP_BASIC_ACK_METHOD:
+      {
+	amqp_basic_ack_t* ack = (amqp_basic_ack_t*)frame.payload.method.decoded;
+	mq_confirm(ack->delivery_tag, ack->multiple, MQ_INFLIGHT_ACKED);
+	break;
+      }
+    case AMQP_BASIC_NACK_METHOD:
+      {
+	amqp_basic_nack_t* nack = (amqp_basic_nack_t*)frame.payload.method.decoded;
+	mq_confirm(nack->delivery_tag, nack->multiple, MQ_INFLIGHT_NACKED);
+	break;
+      }
+    case AMQP_CHANNEL_CLOSE_METHOD:
+    case AMQP_CONNECTION_CLOSE_METHOD:
+      D1("The broker closed the channel");
+      mq_broken_connection();
+      return 2;
+    default:
+      D3("Ignoring method 0x%08X", frame.payload.method.id);
+      break;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Wait for all the confirms.
+ * Returns 0 if the replayed messages were all acked, and we are still connected.
+ */
+static int
+mq_flush_confirms(void)
+{
+  int failed;
+
+  if(mq_inflight_count > 0){
+    if(mq_options->connection_opened) mq_wait_confirms(0, 1);
+    else mq_fail_inflight();
+  }
+  failed = mq_replay_failed || !mq_options->connection_opened;
+  mq_replay_failed = 0;
+  return failed;
+}
+
+/*
+ * Publish, and track the confirmation.
+ * Takes ownership of 'owned' (the message itself, or NULL when it comes
+ * from the spool). Returns 0 unless the connection failed.
+ */
+static int
+mq_publish(const char* message, char* owned)
+{
+  struct mq_inflight_s* e;
+
+  if(mq_options->confirm_window > 0){
+
+    if(!mq_inflight){
+      mq_inflight = (struct mq_inflight_s*)calloc(mq_options->confirm_window, sizeof(struct mq_inflight_s));
+      if(!mq_inflight){ D1("Could not allocate the confirm window"); goto fail; }
+    }
+
+    /* Make room in the window */
+    if(mq_wait_confirms(0, 0) ||
+       mq_wait_confirms(mq_options->confirm_window - 1, 1)) goto fail;
+  }
+
+  if(do_send_message(message) != AMQP_STATUS_OK){
+    D2("Unable to send message");
+    mq_broken_connection();
+    goto fail;
+  }
+
+  D2("Message sent to amqp%s://%s:%d/%s", ((mq_options->ssl)?"s":""),
+                                          mq_options->host,
+                                          mq_options->port,
+	                                  mq_options->vhost);
+  if(mq_options->confirm_window <= 0){
+    free(owned);
+    return 0;
+  }
+
+  e = &mq_inflight[(mq_inflight_head + mq_inflight_count) % mq_options->confirm_window];
+  e->tag = ++mq_delivery_tag;
+  e->message = owned;
+  e->state = MQ_INFLIGHT_PENDING;
+  mq_inflight_count++;
+  return 0;
+
+fail:
+  if(owned) mq_add_unconfirmed(owned);
+  else mq_replay_failed = 1;
+  return 1;
+}
+
+/* Replay callbacks */
+static int
+mq_publish_replayed(const char* message, size_t len)
+{
+  return mq_publish(message, NULL);
+}
+
+static int
+mq_flush_replayed(void)
+{
+  return mq_flush_confirms();
+}
+
+/* ================================================
+ *
+ *              Publisher thread
+ *
+ * The SFTP handlers only push a compact event in a bounded
+ * queue, and a dedicated thread builds the messages and talks
+ * to the broker. A slow broker does not stall the SFTP replies
+ * anymore, unless the queue is full (then we wait for room).
+ *
+ * The thread is started lazily, on the first event: we are then
+ * in the (forked) SFTP process, and not in the sshd listener.
+ *
+ * ================================================ */
+
+#define MQ_BATCH_SIZE 256 /* events taken at once from the queue */
+
+static pthread_mutex_t mq_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mq_queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t mq_queue_not_full = PTHREAD_COND_INITIALIZER;
+
+static mq_event_t** mq_queue = NULL;   /* ring buffer */
+static size_t mq_queue_head = 0;       /* next to pop */
+static size_t mq_queue_count = 0;
+static size_t mq_queue_capacity = 0;
+static int mq_queue_stopping = 0;
+
+static pthread_t mq_publisher;
+static int mq_publisher_started = 0;
+
+static void mq_publish_batch(mq_event_t** events, size_t count);
+
+static void*
+mq_publisher_loop(void* arg)
+{
+  mq_event_t* batch[MQ_BATCH_SIZE];
+  struct timespec deadline;
+  size_t i, n;
+
+  D2("Publisher thread started");
+  while(1){
+
+    pthread_mutex_lock(&mq_queue_lock);
+    while(mq_queue_count == 0 && !mq_queue_stopping){
+      if(mq_options->relay_fd >= 0 || !mq_spool_pending()){ /* else, the relay replays it */
+	pthread_cond_wait(&mq_queue_not_empty, &mq_queue_lock);
+	continue;
+      }
+      /* Wake up to replay the spool, even if idle */
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += (mq_options->retry_delay > 0)?mq_options->retry_delay:1;
+      if(pthread_cond_timedwait(&mq_queue_not_empty, &mq_queue_lock, &deadline) == ETIMEDOUT)
+	break;
+    }
+
+    if(mq_queue_count == 0 && mq_queue_stopping){ /* drained */
+      pthread_mutex_unlock(&mq_queue_lock);
+      break;
+    }
+
+    for(n = 0; n < MQ_BATCH_SIZE && mq_queue_count > 0; n++){
+      batch[n] = mq_queue[mq_queue_head];
+      mq_queue_head = (mq_queue_head + 1) % mq_queue_capacity;
+      mq_queue_count--;
+    }
+    pthread_cond_broadcast(&mq_queue_not_full);
+    pthread_mutex_unlock(&mq_queue_lock);
+
+    mq_publish_batch(batch, n); /* n == 0: only replays the spool */
+    for(i = 0; i < n; i++) free(batch[i]);
+  }
+  D2("Publisher thread stopped");
+  return NULL;
+}
+
+/*
+ * In a child forked while the publisher runs: the thread is not
+ * there, and its events and its broker connection are the parent's.
+ * The child starts over, with a connection of its own.
+ */
+static void
+mq_publisher_atfork_child(void)
+{
+  pthread_mutex_init(&mq_queue_lock, NULL);
+  pthread_cond_init(&mq_queue_not_empty, NULL);
+  pthread_cond_init(&mq_queue_not_full, NULL);
+  if(!mq_publisher_started) return;
+  mq_publisher_started = 0;
+  mq_queue = NULL; /* the parent's events */
+  mq_queue_head = mq_queue_count = 0;
+  mq_queue_stopping = 0;
+  mq_inflight_head = mq_inflight_count = 0;
+  mq_unconfirmed_count = 0;
+  mq_delivery_tag = 0;
+  if(mq_options->conn){
+    close(amqp_get_sockfd(mq_options->conn));
+    mq_options->conn = NULL;
+    mq_options->socket = NULL;
+    mq_options->connection_opened = 0;
+  }
+}
+
+/* Must be called with the queue lock held */
+static int
+mq_start_publisher(void)
+{
+  static int atfork = 0;
+
+  if(mq_publisher_started) return 0;
+
+  if(!atfork && pthread_atfork(NULL, NULL, mq_publisher_atfork_child) == 0)
+    atfork = 1;
+
+  mq_queue_capacity = mq_options->queue_size;
+  mq_queue = (mq_event_t**)calloc(mq_queue_capacity, sizeof(mq_event_t*));
+  if(!mq_queue){ D1("Could not allocate the event queue"); return 1; }
+  mq_queue_head = mq_queue_count = 0;
+  mq_queue_stopping = 0;
+
+  if(pthread_create(&mq_publisher, NULL, mq_publisher_loop, NULL) != 0){
+    D1("Could not start the publisher thread");
+    free(mq_queue);
+    mq_queue = NULL;
+    return 2;
+  }
+  mq_publisher_started = 1;
+  return 0;
+}
+
+static void
+mq_stop_publisher(void)
+{
+  if(!mq_publisher_started) return;
+
+  D2("Flushing %zu pending event(s)", mq_queue_count);
+  pthread_mutex_lock(&mq_queue_lock);
+  mq_queue_stopping = 1;
+  pthread_cond_broadcast(&mq_queue_not_empty);
+  pthread_mutex_unlock(&mq_queue_lock);
+
+  pthread_join(mq_publisher, NULL);
+  mq_publisher_started = 0;
+  free(mq_queue);
+  mq_queue = NULL;
+}
+
+/* Takes ownership of ev */
+static int
+mq_enqueue(mq_event_t* ev)
+{
+  if(!ev) return 1;
+
+  pthread_mutex_lock(&mq_queue_lock);
+  if(mq_start_publisher() != 0){
+    pthread_mutex_unlock(&mq_queue_lock);
+    free(ev);
+    return 2;
+  }
+
+  /* Bounded: apply backpressure when the broker can't keep up */
+  while(mq_queue_count == mq_queue_capacity){
+    D2("Event queue full [%zu]: waiting", mq_queue_capacity);
+    pthread_cond_wait(&mq_queue_not_full, &mq_queue_lock);
+  }
+
+  mq_queue[(mq_queue_head + mq_queue_count) % mq_queue_capacity] = ev;
+  mq_queue_count++;
+  pthread_cond_signal(&mq_queue_not_empty);
+  pthread_mutex_unlock(&mq_queue_lock);
+  return 0;
+}
+
+static mq_event_t*
+mq_event_new(int operation, const char* username, const char* filepath, const char* oldpath)
+{
+  size_t ulen = strlen(username) + 1;
+  size_t flen = strlen(filepath) + 1;
+  size_t olen = (oldpath)?(strlen(oldpath) + 1):0;
+  mq_event_t* ev = (mq_event_t*)malloc(sizeof(mq_event_t) + ulen + flen + olen);
+
+  if(!ev){ D1("Could not allocate event"); return NULL; }
+
+  ev->operation = operation;
+  ev->username = (char*)(ev + 1);
+  ev->filepath = ev->username + ulen;
+  ev->oldpath = (oldpath)?(ev->filepath + flen):NULL;
+  memcpy(ev->username, username, ulen);
+  memcpy(ev->filepath, filepath, flen);
+  if(oldpath) memcpy(ev->oldpath, oldpath, olen);
+  ev->filesize = 0;
+  ev->modified = 0;
+  return ev;
+}
+
 /* ================================================
  *
  *                For the messages
@@ -163,155 +692,267 @@ mq_open_connection(void)
 #define MQ_OP_RENAME 3
 
 int
-mq_send_upload(const char* username, const char* filepath, const char* hexdigest, const off_t filesize, const time_t modified)
+mq_send_upload(const char* username, const char* filepath, const checksum_digests_t* digests, const off_t filesize, const time_t modified)
 { 
   D2("%s uploaded %s", username, filepath);
-  _cleanup_str_ char* msg = NULL;
+  mq_event_t* ev = mq_event_new(MQ_OP_UPLOAD, username, filepath, NULL);
+  if(!ev) return 1;
+  ev->digests = *digests;
+  ev->filesize = filesize;
+  ev->modified = modified;
+  return mq_enqueue(ev);
+}
 
-  if(!mq_options->connection_opened /* Not yet logged in */
-     && mq_open_connection() != 0)  /* Error logging in */
-    return 1;
+int
+mq_send_remove(const char* username, const char* filepath)
+{ 
+  D2("%s removed %s", username, filepath);
+  return mq_enqueue(mq_event_new(MQ_OP_REMOVE, username, filepath, NULL));
+}
 
-  msg = build_message(MQ_OP_UPLOAD, username, filepath, hexdigest, filesize, modified, NULL);
-  D3("sending '%s' to %s", msg, mq_options->host);
+int
+mq_send_rename(const char* username, const char* oldpath, const char* newpath)
+{ 
+  D2("%s renamed %s into %s", username, oldpath, newpath);
+  return mq_enqueue(mq_event_new(MQ_OP_RENAME, username, newpath, oldpath));
+}
 
-  if(do_send_message(msg) == AMQP_STATUS_OK){
-    D2("Message sent to amqp%s://%s:%d/%s", ((mq_options->ssl)?"s":""),
-                                            mq_options->host,
-                                            mq_options->port,
-	                                    mq_options->vhost);
-    return 0;
+/*
+ * In the publisher thread.
+ * The messages are handed over to the relay, if any.
+ * Otherwise, the spool is replayed first, to keep the order. The events that
+ * can't be published are spooled, all at once.
+ */
+static void
+mq_publish_batch(mq_event_t** events, size_t count)
+{
+  char* msgs[MQ_BATCH_SIZE];
+  size_t i, j, n = 0;
+
+  for(i = 0; i < count; i++){
+    mq_event_t* ev = events[i];
+    char* msg = build_message(ev->operation, ev->username, ev->filepath,
+			      &ev->digests, ev->filesize, ev->modified, ev->oldpath);
+    if(msg) msgs[n++] = msg;
   }
-  D2("Unable to send message");
-  return 2;
+
+  /* Until the relay fails, if ever: the ones it acknowledged are safe */
+  i = mq_relay_send(msgs, n);
+  for(j = 0; j < i; j++) free(msgs[j]);
+  if(i == n && mq_options->relay_fd >= 0) return;
+
+  mq_publish_messages(msgs + i, n - i);
 }
 
+/*
+ * Publishes the messages, and takes them over. Called by the publisher
+ * thread, and by the relay workers, which have none.
+ * Returns 0 when they are all confirmed by the broker, or spooled.
+ */
 int
-mq_send_remove(const char* username, const char* filepath)
-{ 
-  D2("%s removed %s", username, filepath);
-  _cleanup_str_ char* msg = NULL;
+mq_publish_messages(char** msgs, size_t n)
+{
+  size_t i;
+  int connected, err = 0;
 
-  if(!mq_options->connection_opened /* Not yet logged in */
-     && mq_open_connection() != 0)  /* Error logging in */
-    return 1;
+  connected = (mq_connect() == 0);
 
-  msg = build_message(MQ_OP_REMOVE, username, filepath, NULL, 0, 0, NULL);
-  D3("sending '%s' to %s", msg, mq_options->host);
+  /* Not all replayed: spool the new ones after, to keep the order */
+  if(connected && mq_spool_replay(mq_publish_replayed, mq_flush_replayed) != 0)
+    connected = 0;
 
-  if(do_send_message(msg) == AMQP_STATUS_OK){
-    D2("Message sent to amqp%s://%s:%d/%s", ((mq_options->ssl)?"s":""),
-                                            mq_options->host,
-                                            mq_options->port,
-	                                    mq_options->vhost);
-    return 0;
+  for(i = 0; i < n; i++){
+    D3("sending '%s' to %s", msgs[i], mq_options->host);
+
+    if(!connected){
+      mq_add_unconfirmed(msgs[i]);
+      continue;
+    }
+    if(mq_publish(msgs[i], msgs[i]) != 0)
+      connected = 0;
   }
-  D2("Unable to send message");
-  return 2;
+  mq_flush_confirms();
+
+  if(mq_unconfirmed_count > 0){
+    if(mq_spool_append(mq_unconfirmed, mq_unconfirmed_count) != 0){
+      D1("Lost %zu notification(s)", mq_unconfirmed_count);
+      err = 1;
+    }
+    for(i = 0; i < mq_unconfirmed_count; i++) free(mq_unconfirmed[i]);
+    mq_unconfirmed_count = 0;
+  }
+  return err;
 }
 
-int
-mq_send_rename(const char* username, const char* oldpath, const char* newpath)
-{ 
-  D2("%s renamed %s into %s", username, oldpath, newpath);
-  _cleanup_str_ char* msg = NULL;
-
-  if(!mq_options->connection_opened /* Not yet logged in */
-     && mq_open_connection() != 0)  /* Error logging in */
-    return 1;
-  
-  msg = build_message(MQ_OP_RENAME, username, newpath, NULL, 0, 0, oldpath);
-  D3("sending '%s' to %s", msg, mq_options->host);
-
-  if(do_send_message(msg) == AMQP_STATUS_OK){
-    D2("Message sent to amqp%s://%s:%d/%s", ((mq_options->ssl)?"s":""),
-                                            mq_options->host,
-                                            mq_options->port,
-	                                    mq_options->vhost);
-    return 0;
+/* ================================================
+ *
+ *                JSON encoding
+ *
+ * The messages have a fixed schema, so they are written directly
+ * in a buffer reused from one message to the next (only the
+ * publisher thread builds them). The output is byte-identical to
+ * what json-c produced, with JSON_C_TO_STRING_NOSLASHESCAPE:
+ * no spaces, '/' not escaped, and the other control characters
+ * as \u00xx (lowercase). Non-ASCII bytes are copied as-is.
+ *
+ * ================================================ */
+
+static char* mq_json = NULL;
+static size_t mq_json_size = 0;
+
+static const char mq_hex[] = "0123456789abcdef";
+
+/* 0: as-is, 'u': \u00xx, else the character after the backslash */
+static const char mq_json_escape[256] = {
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  0, 0, '"', /* the rest is 0 */
+  ['\\'] = '\\',
+};
+
+/* Worst case, every byte as \u00xx */
+#define JSON_STR_MAX(len) (6 * (len) + 2)
+#define JSON_INT_MAX 21
+
+static inline char*
+json_str(char* p, const char* s)
+{
+  const unsigned char* c = (const unsigned char*)s;
+  const unsigned char* run;
+
+  *p++ = '"';
+  while(*c){
+    /* Copy the longest run that needs no escaping */
+    run = c;
+    while(*c && !mq_json_escape[*c]) c++;
+    if(c > run){ memcpy(p, run, c - run); p += c - run; }
+    if(!*c) break;
+
+    *p++ = '\\';
+    *p = mq_json_escape[*c];
+    if(*p++ == 'u'){
+      *p++ = '0';
+      *p++ = '0';
+      *p++ = mq_hex[*c >> 4];
+      *p++ = mq_hex[*c & 0xf];
+    }
+    c++;
   }
-  D2("Unable to send message");
-  return 2;
+  *p++ = '"';
+  return p;
 }
 
+static inline char*
+json_int64(char* p, long long v)
+{
+  char tmp[JSON_INT_MAX];
+  char* t = tmp + sizeof(tmp);
+  unsigned long long u = (v < 0)?(0ULL - (unsigned long long)v):(unsigned long long)v;
+
+  do { *--t = '0' + (u % 10); u /= 10; } while(u);
+  if(v < 0) *--t = '-';
+  memcpy(p, t, tmp + sizeof(tmp) - t);
+  return p + (tmp + sizeof(tmp) - t);
+}
+
+static inline char*
+json_hexdigest(char* p, const unsigned char* digest, size_t len)
+{
+  size_t i;
+  *p++ = '"';
+  for(i = 0; i < len; i++){
+    *p++ = mq_hex[digest[i] >> 4];
+    *p++ = mq_hex[digest[i] & 0xf];
+  }
+  *p++ = '"';
+  return p;
+}
+
+#define JSON_LIT(p, lit) do { memcpy(p, lit, sizeof(lit) - 1); p += sizeof(lit) - 1; } while(0)
+
+/* Returns a copy, owned by the caller */
 static char*
 build_message(int operation,
 	      const char* username,
 	      const char* filepath,
-	      const unsigned char *digest,
+	      const checksum_digests_t *digests,
 	      const off_t filesize,
 	      const time_t modified,
 	      const char* oldpath)
 {
-  char* res = NULL;
-  json_object *obj = json_object_new_object();
+  const unsigned char* digest;
+  size_t dlen;
+  int type, first = 1;
+  size_t need;
+  char *p, *res;
+
+  /* Room for the worst case, so the writers don't check */
+  need = JSON_STR_MAX(strlen(username)) + JSON_STR_MAX(strlen(filepath)) + 256 +
+         ((operation == MQ_OP_UPLOAD)?(3 * (2 * MQ_CHECKSUM_MAX_SIZE + 64) + 2 * JSON_INT_MAX):0) +
+         ((operation == MQ_OP_RENAME)?JSON_STR_MAX(strlen(oldpath)):0); /* Not NULL */
+  if(need > mq_json_size){
+    char* tmp = (char*)realloc(mq_json, need);
+    if(!tmp){ D1("Could not allocate the message buffer"); return NULL; }
+    mq_json = tmp;
+    mq_json_size = need;
+  }
+  p = mq_json;
 
   /* Common things */
-  json_object_object_add(obj,
-			 "user",
-			 json_object_new_string(username));
-  json_object_object_add(obj,
-			 "filepath",
-			 json_object_new_string(filepath));
+  JSON_LIT(p, "{\"user\":");
+  p = json_str(p, username);
+  JSON_LIT(p, ",\"filepath\":");
+  p = json_str(p, filepath);
 
   /* Convert operation */
   switch(operation){
   case MQ_OP_UPLOAD:
-    json_object_object_add(obj,
-			   "operation",
-			   json_object_new_string("upload"));
-    /* Checksum */
-    int i = 0;
-    unsigned char hexdigest[MQ_CHECKSUM_SIZE * 2 + 1];
-    /* memset(hexdigest, '\0', MQ_CHECKSUM_SIZE * 2 + 1); */
-    for (i = 0; i < MQ_CHECKSUM_SIZE; i++) {
-      sprintf(hexdigest + (i * 2), "%02x", digest[i]);
+    JSON_LIT(p, ",\"operation\":\"upload\"");
+    /* Checksums, in a fixed order. None at all if they could not be completed */
+    if(digests->types){
+      JSON_LIT(p, ",\"encrypted_checksums\":[");
+      for(type = MQ_CHECKSUM_SHA256; type & MQ_CHECKSUM_ALL; type <<= 1){
+	if(!(digest = checksum_digest(digests, type, &dlen))) continue;
+	if(!first) *p++ = ',';
+	first = 0;
+	JSON_LIT(p, "{\"type\":");
+	p = json_str(p, checksum_type_name(type));
+	JSON_LIT(p, ",\"value\":");
+	p = json_hexdigest(p, digest, dlen);
+	*p++ = '}';
+      }
+      *p++ = ']';
     }
-    hexdigest[MQ_CHECKSUM_SIZE * 2] = '\0';
-    json_object *jchecksum = json_object_new_object();
-    json_object_object_add(jchecksum, "type", json_object_new_string(MQ_CHECKSUM_TYPE));
-    json_object_object_add(jchecksum, "value", json_object_new_string(hexdigest));
-    json_object *jarray = json_object_new_array();
-    json_object_array_add(jarray, jchecksum);
-    json_object_object_add(obj,
-			   "encrypted_checksums",
-			   jarray);
     /* Filesize */
-    json_object_object_add(obj,
-			   "filesize",
-			   json_object_new_int64(filesize));
+    JSON_LIT(p, ",\"filesize\":");
+    p = json_int64(p, filesize);
     /* Timestamp last modified */
-    json_object_object_add(obj,
-			   "file_last_modified",
-			   json_object_new_int64(modified));
+    JSON_LIT(p, ",\"file_last_modified\":");
+    p = json_int64(p, modified);
     break;
   case MQ_OP_REMOVE:
-    json_object_object_add(obj,
-			   "operation",
-			   json_object_new_string("remove"));
+    JSON_LIT(p, ",\"operation\":\"remove\"");
     break;
   case MQ_OP_RENAME:
-    json_object_object_add(obj,
-			   "operation",
-			   json_object_new_string("rename"));
+    JSON_LIT(p, ",\"operation\":\"rename\"");
     /* Add the oldpath for rename */
-    json_object_object_add(obj,
-			   "oldpath",
-			   json_object_new_string(oldpath)); /* Not NULL */
+    JSON_LIT(p, ",\"oldpath\":");
+    p = json_str(p, oldpath);
     break;
   default:
     D1("Unknown operation: %d", operation);
-    goto final;
+    return NULL;
   }
+  *p++ = '}';
 
-  res = strdup(json_object_to_json_string_ext(obj, JSON_C_TO_STRING_NOSLASHESCAPE));
-
-final:
-  json_object_put(obj); // free json object, and the other ones inside
+  /* The message outlives the buffer: until confirmed, or spooled */
+  res = (char*)malloc(p - mq_json + 1);
+  if(!res){ D1("Could not allocate message"); return NULL; }
+  memcpy(res, mq_json, p - mq_json);
+  res[p - mq_json] = '\0';
   return res;
 }
 
-
 static int
 do_send_message(const char* message)
 {
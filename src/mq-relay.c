@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+
+#include "mq-utils.h"
+#include "mq-config.h"
+#include "mq-notify.h"
+#include "mq-spool.h"
+#include "mq-relay.h"
+
+/*
+ * Local relay to the broker.
+ *
+ * The sshd listener forks a supervisor, which forks relay_connections
+ * workers, and restarts them when they exit. Each holds one long-lived
+ * broker connection. They share a UNIX socket, on which the sessions
+ * hand over their (already built) messages.
+ *
+ * A worker takes what all its sessions sent, publishes it like a
+ * session would (confirms, or else the spool), and then acknowledges
+ * it: one datagram per session, with the number of messages now safe.
+ * A session keeps its messages until then. If the relay is not there,
+ * or goes away before the acknowledgement, the session publishes them
+ * itself, with its own broker connection: some might be published
+ * twice, but none is lost.
+ *
+ * The sessions connect in load_mq_config, before the chroot and the
+ * privilege drop, and keep the descriptor until they exit. One message
+ * per datagram (SOCK_SEQPACKET), so the boundaries are preserved.
+ *
+ * Note: Only the re-executed connection handlers load the MQ config
+ * after the relay is started. With sshd -r, they don't use it.
+ */
+
+#define MQ_RELAY_MAX_MESSAGE 65536
+#define MQ_RELAY_MAX_WORKERS 64
+#define MQ_RELAY_BATCH       256   /* messages published at once, by a worker */
+
+static pid_t mq_relay_supervisor = -1;
+
+static volatile sig_atomic_t mq_relay_stopping = 0;
+
+static int
+relay_address(struct sockaddr_un* addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if(strlen(mq_options->relay) >= sizeof(addr->sun_path)){
+    D1("Relay path too long: %s", mq_options->relay);
+    return 1;
+  }
+  strcpy(addr->sun_path, mq_options->relay);
+  return 0;
+}
+
+/* ================================================
+ *
+ *              Relay workers
+ *
+ * ================================================ */
+
+static void
+relay_sigterm_handler(int sig)
+{
+  mq_relay_stopping = 1;
+}
+
+/* No SA_RESTART: a blocked call returns */
+static void
+relay_signals(void)
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = relay_sigterm_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  prctl(PR_SET_PDEATHSIG, SIGTERM); /* Don't outlive the parent */
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_IGN);
+}
+
+static void
+relay_worker_loop(int lfd)
+{
+  struct pollfd* fds = NULL;
+  uint32_t* counts = NULL;
+  char* msgs[MQ_RELAY_BATCH];
+  size_t nfds = 1, size = 64, i, n;
+  char* buf = NULL;
+  ssize_t len;
+  int fd, rc, timeout;
+
+  mq_relay_disconnect(); /* we are the relay */
+  relay_signals();
+
+  fds = (struct pollfd*)malloc(size * sizeof(struct pollfd));
+  counts = (uint32_t*)calloc(size, sizeof(uint32_t));
+  buf = (char*)malloc(MQ_RELAY_MAX_MESSAGE + 1);
+  if(!fds || !counts || !buf){ D1("Could not allocate the relay buffers"); goto final; }
+
+  fds[0].fd = lfd;
+  fds[0].events = POLLIN;
+
+  D1("Relay worker %d started", (int)getpid());
+  while(!mq_relay_stopping){
+
+    /* Wake up to replay the spool, even if idle */
+    timeout = -1;
+    if(mq_spool_pending())
+      timeout = 1000 * ((mq_options->retry_delay > 0)?mq_options->retry_delay:1);
+
+    if((rc = poll(fds, nfds, timeout)) < 0){
+      if(errno == EINTR) continue;
+      D1("Relay poll error: %s", strerror(errno));
+      break;
+    }
+    if(rc == 0){ mq_publish_messages(NULL, 0); continue; }
+
+    /* New session */
+    if(fds[0].revents & POLLIN){
+      fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+      if(fd < 0){
+	if(errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+	  D1("Relay accept error: %s", strerror(errno));
+      } else {
+	if(nfds == size){
+	  struct pollfd* tmp = (struct pollfd*)realloc(fds, (size << 1) * sizeof(struct pollfd));
+	  uint32_t* ctmp = (tmp)?(uint32_t*)realloc(counts, (size << 1) * sizeof(uint32_t)):NULL;
+	  if(tmp) fds = tmp;
+	  if(!ctmp){ D1("Too many sessions: dropping one"); close(fd); fd = -1; }
+	  else { counts = ctmp; size <<= 1; }
+	}
+	if(fd >= 0){
+	  fds[nfds].fd = fd;
+	  fds[nfds].events = POLLIN;
+	  fds[nfds].revents = 0;
+	  counts[nfds] = 0;
+	  nfds++;
+	}
+      }
+    }
+
+    /* What the sessions sent, up to a batch */
+    for(n = 0, i = 1; i < nfds && n < MQ_RELAY_BATCH; i++){
+      if(!fds[i].revents) continue;
+      while(n < MQ_RELAY_BATCH){
+	len = recv(fds[i].fd, buf, MQ_RELAY_MAX_MESSAGE, MSG_DONTWAIT);
+	if(len > 0){
+	  buf[len] = '\0';
+	  if(!(msgs[n] = strdup(buf))){ D1("Could not keep a relayed message"); fds[i].revents = POLLHUP; break; }
+	  n++;
+	  counts[i]++;
+	  continue;
+	}
+	if(len < 0 && (errno == EINTR || errno == EAGAIN)) break;
+	fds[i].revents = POLLHUP; /* gone, or dropped: closed below */
+	break;
+      }
+    }
+
+    /* Confirmed or spooled: acknowledged. Else the sessions publish them again */
+    if(n > 0 && mq_publish_messages(msgs, n) != 0)
+      for(i = 1; i < nfds; i++) if(counts[i]) fds[i].revents = POLLHUP;
+
+    /* Backwards, so that we can swap in the last one when a session leaves */
+    for(i = nfds - 1; i > 0; i--){
+      if(counts[i] && fds[i].revents != POLLHUP &&
+	 send(fds[i].fd, &counts[i], sizeof(counts[i]), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(counts[i]))
+	fds[i].revents = POLLHUP;
+      counts[i] = 0;
+      if(fds[i].revents != POLLHUP) continue;
+      close(fds[i].fd);
+      fds[i] = fds[--nfds];
+      counts[i] = counts[nfds];
+    }
+  }
+
+final:
+  D1("Relay worker %d stopping", (int)getpid());
+  for(i = 0; fds && i < nfds; i++) close(fds[i].fd);
+  free(fds);
+  free(counts);
+  free(buf);
+  clean_mq_config();
+  _exit(0);
+}
+
+/* Keeps the workers running: a worker that exits is forked again */
+static void
+relay_supervisor_loop(int lfd)
+{
+  pid_t workers[MQ_RELAY_MAX_WORKERS], pid;
+  time_t started[MQ_RELAY_MAX_WORKERS];
+  int nworkers, i, status;
+
+  relay_signals();
+  nworkers = (mq_options->relay_connections < MQ_RELAY_MAX_WORKERS)?mq_options->relay_connections:MQ_RELAY_MAX_WORKERS;
+  for(i = 0; i < nworkers; i++){ workers[i] = -1; started[i] = 0; }
+
+  while(!mq_relay_stopping){
+
+    for(i = 0; i < nworkers && !mq_relay_stopping; i++){
+      if(workers[i] > 0) continue;
+      if(time(NULL) - started[i] < 1) sleep(1); /* not in a loop, if it can't start */
+      started[i] = time(NULL);
+      pid = fork();
+      if(pid < 0){ D1("Could not fork a relay worker: %s", strerror(errno)); continue; }
+      if(pid == 0) relay_worker_loop(lfd); /* does not return */
+      workers[i] = pid;
+    }
+
+    pid = waitpid(-1, &status, 0);
+    if(pid < 0){
+      if(errno == ECHILD) sleep(1); /* none could be forked */
+      continue;
+    }
+    for(i = 0; i < nworkers; i++){
+      if(workers[i] != pid) continue;
+      if(!mq_relay_stopping) D1("Relay worker %d exited (status %d): restarting it", (int)pid, status);
+      workers[i] = -1;
+    }
+  }
+
+  for(i = 0; i < nworkers; i++) if(workers[i] > 0) kill(workers[i], SIGTERM);
+  while(waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+  _exit(0);
+}
+
+/*
+ * In the sshd listener, before it listens: so the workers don't get
+ * the listening sockets. They are forked after the config is loaded,
+ * and open their broker connection lazily, as the sessions did.
+ */
+int
+mq_relay_start(void)
+{
+  struct sockaddr_un addr;
+  int lfd;
+  pid_t pid;
+
+  if(!mq_options || !mq_options->relay || !*mq_options->relay) return 0;
+  if(relay_address(&addr)) return 1;
+
+  /* Non-blocking: all the workers poll it, and only one gets each session */
+  lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if(lfd < 0){ D1("Could not create the relay socket: %s", strerror(errno)); return 2; }
+
+  unlink(mq_options->relay); /* from a previous run */
+  if(bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+     chmod(mq_options->relay, 0600) != 0 ||  /* the sessions connect as root */
+     listen(lfd, SOMAXCONN) != 0){
+    D1("Could not listen on %s: %s", mq_options->relay, strerror(errno));
+    close(lfd);
+    return 3;
+  }
+
+  pid = fork();
+  if(pid == 0) relay_supervisor_loop(lfd); /* does not return */
+  close(lfd);
+  if(pid < 0){
+    D1("Could not fork the relay: %s", strerror(errno));
+    unlink(mq_options->relay);
+    return 4;
+  }
+  mq_relay_supervisor = pid;
+  D2("Started the relay on %s, with %d worker(s)", mq_options->relay, mq_options->relay_connections);
+  return 0;
+}
+
+/* Before the listener exits or restarts */
+void
+mq_relay_stop(void)
+{
+  if(mq_relay_supervisor < 0) return;
+
+  /* No new session should find them */
+  unlink(mq_options->relay);
+  kill(mq_relay_supervisor, SIGTERM); /* and it stops the workers */
+  mq_relay_supervisor = -1;
+}
+
+/* ================================================
+ *
+ *              Sessions
+ *
+ * ================================================ */
+
+/* Before the chroot */
+int
+mq_relay_connect(void)
+{
+  struct sockaddr_un addr;
+
+  mq_options->relay_fd = -1;
+  if(!mq_options->relay || !*mq_options->relay) return 0;
+  if(relay_address(&addr)) return 1;
+
+  mq_options->relay_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if(mq_options->relay_fd < 0){ D1("Could not create a relay socket: %s", strerror(errno)); return 2; }
+
+  if(connect(mq_options->relay_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0){
+    D2("No relay on %s: %s", mq_options->relay, strerror(errno));
+    mq_relay_disconnect();
+    return 3;
+  }
+  D2("Connected to the relay on %s", mq_options->relay);
+  return 0;
+}
+
+void
+mq_relay_disconnect(void)
+{
+  if(mq_options->relay_fd < 0) return;
+  close(mq_options->relay_fd);
+  mq_options->relay_fd = -1;
+}
+
+/*
+ * In the publisher thread.
+ * Hands the messages over, and waits until the relay has them confirmed
+ * by the broker, or spooled. Blocks when the relay can't keep up, like
+ * the broker would. Returns how many, from the first, are acknowledged:
+ * on error, the relay is dropped, and the caller publishes the others.
+ */
+size_t
+mq_relay_send(char** messages, size_t count)
+{
+  size_t sent, acked = 0, len;
+  uint32_t ack;
+  ssize_t rc;
+
+  if(mq_options->relay_fd < 0) return 0;
+
+  for(sent = 0; sent < count; sent++){
+    len = strlen(messages[sent]);
+    if(len > MQ_RELAY_MAX_MESSAGE){ D2("Message too large for the relay"); break; }
+    do {
+      rc = send(mq_options->relay_fd, messages[sent], len, MSG_NOSIGNAL);
+    } while(rc < 0 && errno == EINTR);
+    if(rc != (ssize_t)len){
+      D1("Lost the relay: %s", (rc < 0)?strerror(errno):"short send");
+      goto fail;
+    }
+  }
+
+  while(acked < sent){
+    do {
+      rc = recv(mq_options->relay_fd, &ack, sizeof(ack), 0);
+    } while(rc < 0 && errno == EINTR);
+    if(rc != sizeof(ack) || ack > sent - acked){
+      D1("Lost the relay: %s", (rc < 0)?strerror(errno):"no acknowledgement");
+      goto fail;
+    }
+    acked += ack;
+  }
+  D3("%zu message(s) handed over to the relay", acked);
+  return acked;
+
+fail:
+  mq_relay_disconnect();
+  return acked;
+}
@@ -0,0 +1,15 @@
+#ifndef __MQ_RELAY_H_INCLUDED__
+#define __MQ_RELAY_H_INCLUDED__
+
+#include <sys/types.h>
+
+/* In the sshd listener */
+int mq_relay_start(void);
+void mq_relay_stop(void);
+
+/* In the sessions */
+int mq_relay_connect(void);
+void mq_relay_disconnect(void);
+size_t mq_relay_send(char** messages, size_t count);
+
+#endif /* !__MQ_RELAY_H_INCLUDED__ */
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+
+#include "mq-utils.h"
+#include "mq-sha256.h"
+
+/*
+ * SHA-256 compression, dispatched once at runtime:
+ *
+ *   - "sha-ni":  the x86 SHA extensions, when the CPU has them
+ *                (and the compiler knows the intrinsics: gcc >= 4.9)
+ *   - "openssl": OpenSSL's block function, which has its own
+ *                assembly paths (AVX2, AVX, SSSE3, ...)
+ *
+ * We keep the chaining value ourselves, instead of a SHA256_CTX,
+ * so that it can be saved and restored.
+ */
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MQ_SHA256_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*sha256_blocks_fn)(uint32_t state[8], const unsigned char* data, size_t nblocks);
+
+static const uint32_t sha256_h0[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* ================================================
+ *
+ *                OpenSSL
+ *
+ * ================================================ */
+
+static void
+sha256_blocks_openssl(uint32_t state[8], const unsigned char* data, size_t nblocks)
+{
+  SHA256_CTX ctx;
+
+  /* Whole blocks, from an empty buffer: they go straight to the block function */
+  SHA256_Init(&ctx);
+  memcpy(ctx.h, state, sizeof(ctx.h));
+  SHA256_Update(&ctx, data, nblocks * MQ_SHA256_BLOCK_SIZE);
+  memcpy(state, ctx.h, sizeof(ctx.h));
+}
+
+/* ================================================
+ *
+ *                SHA extensions
+ *
+ * ================================================ */
+
+#ifdef MQ_SHA256_SHANI
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*
+ * Rounds 4g to 4g+3, on the message words in 'cur'.
+ * Meanwhile, the words of the group g+1 (in 'next') are finished,
+ * and the ones of the group g+3 (in 'prev') are started.
+ */
+#define SHANI_QROUND(g, cur, prev, next)					\
+  do {									\
+    msg = _mm_add_epi32(cur, _mm_load_si128((const __m128i*)&sha256_k[4*(g)])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);		\
+    if((g) >= 3 && (g) <= 14){						\
+      tmp = _mm_alignr_epi8(cur, prev, 4);				\
+      next = _mm_sha256msg2_epu32(_mm_add_epi32(next, tmp), cur);	\
+    }									\
+    msg = _mm_shuffle_epi32(msg, 0x0E);					\
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);		\
+    if((g) >= 1 && (g) <= 12)						\
+      prev = _mm_sha256msg1_epu32(prev, cur);				\
+  } while(0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_blocks_shani(uint32_t state[8], const unsigned char* data, size_t nblocks)
+{
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, msg, tmp, m0, m1, m2, m3, abef, cdgh;
+
+  /* Words as ABEF and CDGH, as the instructions want them */
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1); /* CDAB */
+  state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B); /* EFGH */
+  state0 = _mm_alignr_epi8(tmp, state1, 8);    /* ABEF */
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0); /* CDGH */
+
+  while(nblocks--){
+    abef = state0;
+    cdgh = state1;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data +  0)), mask);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+
+    SHANI_QROUND( 0, m0, m3, m1);
+    SHANI_QROUND( 1, m1, m0, m2);
+    SHANI_QROUND( 2, m2, m1, m3);
+    SHANI_QROUND( 3, m3, m2, m0);
+    SHANI_QROUND( 4, m0, m3, m1);
+    SHANI_QROUND( 5, m1, m0, m2);
+    SHANI_QROUND( 6, m2, m1, m3);
+    SHANI_QROUND( 7, m3, m2, m0);
+    SHANI_QROUND( 8, m0, m3, m1);
+    SHANI_QROUND( 9, m1, m0, m2);
+    SHANI_QROUND(10, m2, m1, m3);
+    SHANI_QROUND(11, m3, m2, m0);
+    SHANI_QROUND(12, m0, m3, m1);
+    SHANI_QROUND(13, m1, m0, m2);
+    SHANI_QROUND(14, m2, m1, m3);
+    SHANI_QROUND(15, m3, m2, m0);
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    data += MQ_SHA256_BLOCK_SIZE;
+  }
+
+  /* Back to ABCD and EFGH */
+  tmp = _mm_shuffle_epi32(state0, 0x1B);       /* FEBA */
+  state1 = _mm_shuffle_epi32(state1, 0xB1);    /* DCHG */
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0); /* DCBA */
+  state1 = _mm_alignr_epi8(state1, tmp, 8);    /* HGFE */
+  _mm_storeu_si128((__m128i*)&state[0], state0);
+  _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+static int
+cpu_has_shani(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if(__get_cpuid_max(0, NULL) < 7) return 0;
+  __cpuid(1, eax, ebx, ecx, edx);
+  if(!(ecx & bit_SSE4_1)) return 0;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx >> 29) & 1; /* SHA */
+}
+#endif /* !MQ_SHA256_SHANI */
+
+/* ================================================
+ *
+ *                Dispatch
+ *
+ * ================================================ */
+
+static sha256_blocks_fn sha256_blocks = NULL;
+static const char* sha256_name = NULL;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void
+sha256_select(void)
+{
+#ifdef MQ_SHA256_SHANI
+  if(cpu_has_shani()){
+    sha256_blocks = sha256_blocks_shani;
+    sha256_name = "sha-ni";
+    goto final;
+  }
+#endif
+  sha256_blocks = sha256_blocks_openssl;
+  sha256_name = "openssl";
+
+#ifdef MQ_SHA256_SHANI
+final:
+#endif
+  D2("SHA-256 implementation: %s", sha256_name);
+}
+
+const char*
+mq_sha256_implementation(void)
+{
+  pthread_once(&sha256_once, sha256_select);
+  return sha256_name;
+}
+
+void
+mq_sha256_init(uint32_t state[8])
+{
+  pthread_once(&sha256_once, sha256_select);
+  memcpy(state, sha256_h0, sizeof(sha256_h0));
+}
+
+void
+mq_sha256_blocks(uint32_t state[8], const unsigned char* data, size_t nblocks)
+{
+  if(nblocks) sha256_blocks(state, data, nblocks);
+}
+
+void
+mq_sha256_final(uint32_t state[8], const unsigned char* last, size_t len, uint64_t total,
+		unsigned char out[MQ_SHA256_DIGEST_SIZE])
+{
+  unsigned char block[2 * MQ_SHA256_BLOCK_SIZE];
+  size_t n = (len < 56)?MQ_SHA256_BLOCK_SIZE:(2 * MQ_SHA256_BLOCK_SIZE);
+  uint64_t bits = total << 3;
+  int i;
+
+  memset(block, 0, sizeof(block));
+  memcpy(block, last, len);
+  block[len] = 0x80;
+  for(i = 0; i < 8; i++) block[n - 1 - i] = (unsigned char)(bits >> (8 * i));
+  mq_sha256_blocks(state, block, n / MQ_SHA256_BLOCK_SIZE);
+
+  for(i = 0; i < 8; i++){
+    out[4*i    ] = (unsigned char)(state[i] >> 24);
+    out[4*i + 1] = (unsigned char)(state[i] >> 16);
+    out[4*i + 2] = (unsigned char)(state[i] >> 8);
+    out[4*i + 3] = (unsigned char)(state[i]);
+  }
+}
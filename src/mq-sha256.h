@@ -0,0 +1,22 @@
+#ifndef __MQ_SHA256_H_INCLUDED__
+#define __MQ_SHA256_H_INCLUDED__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MQ_SHA256_BLOCK_SIZE  64
+#define MQ_SHA256_DIGEST_SIZE 32
+
+/* Flat state: the chaining value only, the caller buffers the partial block */
+void mq_sha256_init(uint32_t state[8]);
+
+/* Compresses nblocks full blocks, with the best implementation for this CPU */
+void mq_sha256_blocks(uint32_t state[8], const unsigned char* data, size_t nblocks);
+
+/* Pads the remaining len (< 64) bytes, given the total length, and outputs the digest */
+void mq_sha256_final(uint32_t state[8], const unsigned char* last, size_t len, uint64_t total,
+		     unsigned char out[MQ_SHA256_DIGEST_SIZE]);
+
+const char* mq_sha256_implementation(void);
+
+#endif /* !__MQ_SHA256_H_INCLUDED__ */
@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+
+#include "mq-utils.h"
+#include "mq-config.h"
+#include "mq-spool.h"
+
+/*
+ * Append-only spool of the notifications that could not be sent.
+ *
+ * It is opened before the chroot, and shared by all the sessions.
+ * Layout: a header, followed by records of the form
+ *           <u32 length> <message (not NUL-terminated)>
+ * The header records where the replay should restart. Once every
+ * record is replayed, the file is truncated back to its header.
+ *
+ * Two POSIX locks, on a byte each: one held while the file changes
+ * (appends, header, truncation), the other by the one session that
+ * replays it. The replayer only takes the first one briefly, so the
+ * other sessions keep appending while it waits on the broker.
+ * Appends are grouped: one write and one fdatasync per batch.
+ */
+
+#define MQ_SPOOL_MAGIC      "EGAMQSP1"
+#define MQ_SPOOL_MAGIC_LEN  8
+#define MQ_SPOOL_CHECKPOINT 128  /* save the replay offset every so many records */
+
+#define MQ_SPOOL_LOCK_DATA   0   /* the bytes locked */
+#define MQ_SPOOL_LOCK_REPLAY 1
+
+struct mq_spool_header_s {
+  char magic[MQ_SPOOL_MAGIC_LEN];
+  uint64_t offset;             /* first record not yet replayed */
+};
+typedef struct mq_spool_header_s mq_spool_header_t;
+
+/* Returns -1 if it is held elsewhere and not 'wait' */
+static int
+spool_lock_byte(int type, off_t byte, int wait)
+{
+  struct flock fl;
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = byte;
+  fl.l_len = 1;
+  while(fcntl(mq_options->spool_fd, (wait)?F_SETLKW:F_SETLK, &fl) == -1){
+    if(!wait && (errno == EACCES || errno == EAGAIN)) return -1;
+    if(errno != EINTR){ D1("Could not lock the spool: %s", strerror(errno)); return 1; }
+  }
+  return 0;
+}
+#define spool_lock(type) spool_lock_byte((type), MQ_SPOOL_LOCK_DATA, 1)
+#define spool_unlock() spool_lock(F_UNLCK)
+
+static int
+spool_read_header(mq_spool_header_t* h)
+{
+  if(pread(mq_options->spool_fd, h, sizeof(*h), 0) != sizeof(*h) ||
+     memcmp(h->magic, MQ_SPOOL_MAGIC, MQ_SPOOL_MAGIC_LEN)){
+    D1("Invalid spool header");
+    return 1;
+  }
+  return 0;
+}
+
+static int
+spool_write_header(uint64_t offset)
+{
+  mq_spool_header_t h;
+  memcpy(h.magic, MQ_SPOOL_MAGIC, MQ_SPOOL_MAGIC_LEN);
+  h.offset = offset;
+  if(pwrite(mq_options->spool_fd, &h, sizeof(h), 0) != sizeof(h)){
+    D1("Could not write the spool header: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/* Where the next replay starts */
+static void
+spool_save_offset(uint64_t offset)
+{
+  if(spool_lock(F_WRLCK)) return;
+  spool_write_header(offset);
+  fdatasync(mq_options->spool_fd);
+  spool_unlock();
+}
+
+/* Before the chroot */
+int
+mq_spool_open(const char* path)
+{
+  struct stat st;
+  int rc = 0;
+
+  mq_options->spool_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if(mq_options->spool_fd < 0){
+    D1("Could not open the spool %s: %s", path, strerror(errno));
+    return 1;
+  }
+
+  if(spool_lock(F_WRLCK)) goto fail;
+  if(fstat(mq_options->spool_fd, &st) == 0 && st.st_size < (off_t)sizeof(mq_spool_header_t)){
+    D2("Initializing spool %s", path);
+    rc = spool_write_header(sizeof(mq_spool_header_t)) || ftruncate(mq_options->spool_fd, sizeof(mq_spool_header_t));
+  }
+  spool_unlock();
+  if(!rc) return 0;
+
+fail:
+  close(mq_options->spool_fd);
+  mq_options->spool_fd = -1;
+  return 2;
+}
+
+void
+mq_spool_close(void)
+{
+  if(mq_options->spool_fd < 0) return;
+  close(mq_options->spool_fd);
+  mq_options->spool_fd = -1;
+}
+
+/* Group commit: all the messages with one write and one fdatasync */
+int
+mq_spool_append(char** messages, size_t count)
+{
+  struct iovec iov[2 * 512];
+  uint32_t lens[512];
+  struct stat st;
+  off_t end;
+  size_t i, n;
+  ssize_t len, rc;
+  int err = 0;
+
+  if(mq_options->spool_fd < 0){ D1("No spool: dropping %zu message(s)", count); return 1; }
+  if(spool_lock(F_WRLCK)) return 2;
+
+  if(fstat(mq_options->spool_fd, &st) != 0){ err = 3; goto final; }
+  end = st.st_size;
+
+  for(i = 0; i < count; i += n){
+    n = 0; len = 0;
+    while(n < 512 && i + n < count){
+      lens[n] = strlen(messages[i+n]);
+      iov[2*n].iov_base = &lens[n];
+      iov[2*n].iov_len = sizeof(uint32_t);
+      iov[2*n+1].iov_base = messages[i+n];
+      iov[2*n+1].iov_len = lens[n];
+      len += sizeof(uint32_t) + lens[n];
+      n++;
+    }
+    rc = pwritev(mq_options->spool_fd, iov, 2*n, end);
+    if(rc != len){
+      D1("Could not append to the spool: %s", (rc < 0)?strerror(errno):"short write");
+      /* Drop the partial record(s) */
+      if(ftruncate(mq_options->spool_fd, end)){ D1("Could not clean the spool"); }
+      err = 4;
+      goto final;
+    }
+    end += len;
+  }
+
+  if(fdatasync(mq_options->spool_fd)){ D1("Could not sync the spool: %s", strerror(errno)); err = 5; }
+  D2("Spooled %zu message(s)", count);
+
+final:
+  spool_unlock();
+  return err;
+}
+
+int
+mq_spool_pending(void)
+{
+  mq_spool_header_t h;
+  struct stat st;
+
+  if(mq_options->spool_fd < 0) return 0;
+  if(spool_read_header(&h) || fstat(mq_options->spool_fd, &st)) return 0;
+  return (uint64_t)st.st_size > h.offset;
+}
+
+/*
+ * Publish the spooled messages in order.
+ * The replay offset only moves past the messages that are confirmed,
+ * one checkpoint at a time: after a failure, some messages might be
+ * published twice, but none is lost.
+ *
+ * The records are read from a snapshot of the file: the ones it holds
+ * are complete, and only the replayer changes them, so they are
+ * published without the lock. What is appended in the meantime is
+ * replayed next, until the replayer catches up.
+ *
+ * Returns 0 when the spool is empty, and 1 if the publisher failed or
+ * another session replays it (the remaining messages stay in the spool,
+ * and the new ones go behind them).
+ */
+int
+mq_spool_replay(mq_spool_publish_t publish, mq_spool_flush_t flush)
+{
+  mq_spool_header_t h;
+  struct stat st;
+  uint64_t offset, confirmed, end;
+  uint32_t len;
+  char* buf = NULL;
+  size_t buflen = 0;
+  int err = 0, count = 0, rc;
+
+  if(mq_options->spool_fd < 0) return 0;
+  if((rc = spool_lock_byte(F_WRLCK, MQ_SPOOL_LOCK_REPLAY, 0)) != 0){
+    if(rc < 0) D2("The spool is replayed by another session");
+    return 1;
+  }
+
+  if(spool_lock(F_WRLCK)){ err = 1; goto final; }
+  rc = spool_read_header(&h) || fstat(mq_options->spool_fd, &st);
+  spool_unlock();
+  if(rc){ err = 1; goto final; }
+
+  offset = confirmed = h.offset;
+  end = st.st_size;
+  if(end <= offset) goto final; /* nothing to replay */
+  D2("Replaying the spool from offset %llu", (unsigned long long)offset);
+
+  while(1){
+
+    while(offset + sizeof(uint32_t) <= end){
+
+      if(pread(mq_options->spool_fd, &len, sizeof(len), offset) != sizeof(len)){ err = 1; break; }
+      if(offset + sizeof(len) + len > end) break; /* torn: dropped below */
+
+      if(buflen < (size_t)len + 1){
+	char* nbuf = realloc(buf, (size_t)len + 1);
+	if(!nbuf){ err = 1; break; }
+	buf = nbuf;
+	buflen = (size_t)len + 1;
+      }
+      if(pread(mq_options->spool_fd, buf, len, offset + sizeof(len)) != (ssize_t)len){ err = 1; break; }
+      buf[len] = '\0';
+
+      if(publish(buf, len)){ err = 1; break; }
+
+      offset += sizeof(len) + len;
+      if(++count % MQ_SPOOL_CHECKPOINT == 0){
+	if(flush()){ err = 1; break; }
+	confirmed = offset;
+	spool_save_offset(confirmed);
+      }
+    }
+    if(err || flush()){ err = 1; break; }
+    confirmed = offset;
+
+    if(spool_lock(F_WRLCK)){ err = 1; break; }
+    if(fstat(mq_options->spool_fd, &st)){ spool_unlock(); err = 1; break; }
+    if(offset == end && (uint64_t)st.st_size > end){ /* appended since */
+      spool_unlock();
+      end = st.st_size;
+      continue;
+    }
+    /* All replayed: start over */
+    if(offset < end)
+      D1("Dropped a truncated spool record at offset %llu: %llu byte(s) lost",
+	 (unsigned long long)offset, (unsigned long long)st.st_size - offset);
+    D2("Spool replayed: %d message(s)", count);
+    if(ftruncate(mq_options->spool_fd, sizeof(mq_spool_header_t))){ D1("Could not truncate the spool"); }
+    spool_write_header(sizeof(mq_spool_header_t));
+    fdatasync(mq_options->spool_fd);
+    spool_unlock();
+    goto final;
+  }
+
+  /* For the next replay */
+  spool_save_offset(confirmed);
+
+final:
+  spool_lock_byte(F_UNLCK, MQ_SPOOL_LOCK_REPLAY, 1);
+  free(buf);
+  return err;
+}
@@ -0,0 +1,18 @@
+#ifndef __MQ_SPOOL_H_INCLUDED__
+#define __MQ_SPOOL_H_INCLUDED__
+
+#include <sys/types.h>
+
+/* Called with a NUL-terminated message. Returns 0 on success. */
+typedef int (*mq_spool_publish_t)(const char* message, size_t len);
+/* Returns 0 when all the messages published so far are confirmed */
+typedef int (*mq_spool_flush_t)(void);
+
+int mq_spool_open(const char* path);
+void mq_spool_close(void);
+
+int mq_spool_append(char** messages, size_t count);
+int mq_spool_pending(void);
+int mq_spool_replay(mq_spool_publish_t publish, mq_spool_flush_t flush);
+
+#endif /* !__MQ_SPOOL_H_INCLUDED__ */
@@ -51,6 +51,7 @@
 #endif
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <errno.h>
@@ -195,6 +196,12 @@ struct ssh_channels {
 	/* Deadline after which all X11 connections are refused */
 	u_int x11_refuse_time;
 
+	/* Ceiling of the adaptive read size of the channels */
+	u_int rbuf_max;
+
+	/* Ceiling of the autotuned receive windows */
+	u_int window_max;
+
 	/*
 	 * Fake X11 authentication data.  This is what the server will be
 	 * sending us; we should replace any occurrences of this by the
@@ -236,6 +243,8 @@ channel_init_channels(struct ssh *ssh)
 	sc->channels_alloc = 10;
 	sc->channels = xcalloc(sc->channels_alloc, sizeof(*sc->channels));
 	sc->IPv4or6 = AF_UNSPEC;
+	sc->rbuf_max = CHAN_RBUF_MAX;
+	sc->window_max = CHAN_SES_WINDOW_MAX;
 	channel_handler_init(sc);
 
 	ssh->chanctxt = sc;
@@ -389,6 +398,7 @@ channel_new(struct ssh *ssh, char *ctype, int type, int rfd, int wfd, int efd,
 		fatal("%s: sshbuf_new failed", __func__);
 	c->ostate = CHAN_OUTPUT_OPEN;
 	c->istate = CHAN_INPUT_OPEN;
+	c->inproc_fd = -1;
 	channel_register_fds(ssh, c, rfd, wfd, efd, extusage, nonblock, 0);
 	c->self = found;
 	c->type = type;
@@ -396,6 +406,7 @@ channel_new(struct ssh *ssh, char *ctype, int type, int rfd, int wfd, int efd,
 	c->local_window = window;
 	c->local_window_max = window;
 	c->local_maxpacket = maxpack;
+	c->rbuf_size = CHAN_RBUF;
 	c->remote_name = xstrdup(remote_name);
 	c->ctl_chan = -1;
 	c->delayed = 1;		/* prevent call to channel_post handler */
@@ -417,6 +428,7 @@ channel_find_maxfd(struct ssh_channels *sc)
 			max = MAXIMUM(max, c->rfd);
 			max = MAXIMUM(max, c->wfd);
 			max = MAXIMUM(max, c->efd);
+			max = MAXIMUM(max, c->inproc_fd);
 		}
 	}
 	sc->channel_max_fd = max;
@@ -949,6 +961,28 @@ channel_register_open_confirm(struct ssh *ssh, int id,
 	c->open_confirm_ctx = ctx;
 }
 
+/*
+ * The channel has no descriptors: 'fn' is called before its input is
+ * sent, to consume the data of its output buffer and to append the
+ * replies to its input buffer. 'fd', if not -1, becomes readable when
+ * replies completed in the background wait for 'fn'.
+ */
+void
+channel_register_inproc(struct ssh *ssh, int id, channel_callback_fn *fn,
+    void *ctx, int fd)
+{
+	Channel *c = channel_lookup(ssh, id);
+
+	if (c == NULL) {
+		logit("%s: %d: bad id", __func__, id);
+		return;
+	}
+	c->inproc = fn;
+	c->inproc_ctx = ctx;
+	c->inproc_fd = fd;
+	channel_find_maxfd(ssh->chanctxt);
+}
+
 void
 channel_register_cleanup(struct ssh *ssh, int id,
     channel_callback_fn *fn, int do_close)
@@ -1034,15 +1068,16 @@ static void
 channel_pre_open(struct ssh *ssh, Channel *c,
     fd_set *readset, fd_set *writeset)
 {
-	if (c->istate == CHAN_INPUT_OPEN &&
+	if (c->istate == CHAN_INPUT_OPEN && c->rfd != -1 &&
 	    c->remote_window > 0 &&
 	    sshbuf_len(c->input) < c->remote_window &&
-	    sshbuf_check_reserve(c->input, CHAN_RBUF) == 0)
+	    sshbuf_check_reserve(c->input, c->rbuf_size) == 0)
 		FD_SET(c->rfd, readset);
 	if (c->ostate == CHAN_OUTPUT_OPEN ||
 	    c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
 		if (sshbuf_len(c->output) > 0) {
-			FD_SET(c->wfd, writeset);
+			if (c->wfd != -1)
+				FD_SET(c->wfd, writeset);
 		} else if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
 			if (CHANNEL_EFD_OUTPUT_ACTIVE(c))
 				debug2("channel %d: "
@@ -1065,6 +1100,9 @@ channel_pre_open(struct ssh *ssh, Channel *c,
 			FD_SET(c->efd, readset);
 	}
 	/* XXX: What about efd? races? */
+	if (c->inproc != NULL && c->inproc_fd != -1 &&
+	    !(c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD)))
+		FD_SET(c->inproc_fd, readset);
 }
 
 /*
@@ -1172,7 +1210,7 @@ channel_pre_mux_client(struct ssh *ssh,
     Channel *c, fd_set *readset, fd_set *writeset)
 {
 	if (c->istate == CHAN_INPUT_OPEN && !c->mux_pause &&
-	    sshbuf_check_reserve(c->input, CHAN_RBUF) == 0)
+	    sshbuf_check_reserve(c->input, c->rbuf_size) == 0)
 		FD_SET(c->rfd, readset);
 	if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
 		/* clear buffer immediately (discard any partial packet) */
@@ -1892,21 +1930,55 @@ channel_post_connecting(struct ssh *ssh, Channel *c,
 	}
 }
 
+/*
+ * Adapts the read size to the traffic: it doubles when a read fills it,
+ * up to the ceiling, and shrinks back when the reads get small.
+ */
+static void
+channel_adapt_rbuf(struct ssh *ssh, Channel *c, size_t len)
+{
+	u_int max = ssh->chanctxt->rbuf_max;
+
+	if (len == c->rbuf_size && c->rbuf_size < max) {
+		c->rbuf_size = MINIMUM(c->rbuf_size * 2, max);
+		debug3("channel %d: read size %u", c->self, c->rbuf_size);
+	} else if (len < c->rbuf_size / 8 && c->rbuf_size > CHAN_RBUF)
+		c->rbuf_size = MAXIMUM(c->rbuf_size / 2, CHAN_RBUF);
+}
+
 static int
 channel_handle_rfd(struct ssh *ssh, Channel *c,
     fd_set *readset, fd_set *writeset)
 {
 	char buf[CHAN_RBUF];
+	u_char *p;
+	size_t rlen;
 	ssize_t len;
-	int r, force;
+	int r, force, direct;
 
 	force = c->isatty && c->detach_close && c->istate != CHAN_INPUT_CLOSED;
 
 	if (c->rfd == -1 || (!force && !FD_ISSET(c->rfd, readset)))
 		return 1;
 
+	/* Without a filter, read straight into the input buffer */
+	direct = c->input_filter == NULL && !c->datagram;
+	if (direct) {
+		rlen = c->rbuf_size;
+		if ((r = sshbuf_reserve(c->input, rlen, &p)) != 0)
+			fatal("%s: channel %d: reserve: %s", __func__,
+			    c->self, ssh_err(r));
+	} else {
+		rlen = sizeof(buf);
+		p = buf;
+	}
+
 	errno = 0;
-	len = read(c->rfd, buf, sizeof(buf));
+	len = read(c->rfd, p, rlen);
+	if (direct && (r = sshbuf_consume_end(c->input,
+	    rlen - (len > 0 ? len : 0))) != 0)
+		fatal("%s: channel %d: consume: %s", __func__,
+		    c->self, ssh_err(r));
 	if (len < 0 && (errno == EINTR ||
 	    ((errno == EAGAIN || errno == EWOULDBLOCK) && !force)))
 		return 1;
@@ -1927,17 +1999,15 @@ channel_handle_rfd(struct ssh *ssh, Channel *c,
 		}
 		return -1;
 	}
-	if (c->input_filter != NULL) {
+	if (direct) {
+		channel_adapt_rbuf(ssh, c, len);
+	} else if (c->input_filter != NULL) {
 		if (c->input_filter(ssh, c, buf, len) == -1) {
 			debug2("channel %d: filter stops", c->self);
 			chan_read_failed(ssh, c);
 		}
-	} else if (c->datagram) {
-		if ((r = sshbuf_put_string(c->input, buf, len)) != 0)
-			fatal("%s: channel %d: put datagram: %s", __func__,
-			    c->self, ssh_err(r));
-	} else if ((r = sshbuf_put(c->input, buf, len)) != 0) {
-		fatal("%s: channel %d: put data: %s", __func__,
+	} else if ((r = sshbuf_put_string(c->input, buf, len)) != 0) {
+		fatal("%s: channel %d: put datagram: %s", __func__,
 		    c->self, ssh_err(r));
 	}
 	return 1;
@@ -2116,9 +2186,72 @@ channel_handle_efd(struct ssh *ssh, Channel *c,
 	return 1;
 }
 
+/* Smoothed round-trip time of the connection in seconds, or 0 */
+static double
+channel_conn_rtt(struct ssh *ssh)
+{
+#ifdef TCP_INFO
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	if (!ssh_packet_connection_is_on_socket(ssh) ||
+	    getsockopt(ssh_packet_get_connection_in(ssh), IPPROTO_TCP,
+	    TCP_INFO, &ti, &len) != 0 || ti.tcpi_rtt == 0)
+		return 0;
+	return ti.tcpi_rtt / 1e6;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * How much the receive window of 'c' grows with the next adjust.
+ * Over at least a round trip, the bytes received give the bandwidth,
+ * hence the bandwidth-delay product. When the window is not twice as
+ * large, it doubles, up to the ceiling: a window-bound peer then
+ * speeds up, and the next measurement shows it.
+ */
+static u_int
+channel_window_growth(struct ssh *ssh, Channel *c)
+{
+	u_int max = ssh->chanctxt->window_max;
+	u_int64_t bdp, want;
+	double now, elapsed;
+
+	if (!c->local_window_tune || c->local_window_max >= max)
+		return 0;
+	now = monotime_double();
+	if (c->local_tune_rtt == 0) {
+		/* new measurement, from this adjust on */
+		if ((c->local_tune_rtt = channel_conn_rtt(ssh)) == 0) {
+			debug2("channel %d: no round-trip time, window "
+			    "stays at %u", c->self, c->local_window_max);
+			c->local_window_tune = 0;
+			return 0;
+		}
+		c->local_tune_start = now;
+		c->local_tune_bytes = 0;
+		return 0;
+	}
+	c->local_tune_bytes += c->local_consumed;
+	if ((elapsed = now - c->local_tune_start) < c->local_tune_rtt)
+		return 0;
+	bdp = c->local_tune_bytes / elapsed * c->local_tune_rtt;
+	c->local_tune_rtt = 0;
+	if (2 * bdp <= c->local_window_max)
+		return 0;
+	want = MINIMUM(2 * bdp, 2 * (u_int64_t)c->local_window_max);
+	want = MINIMUM(want, max);
+	debug2("channel %d: window %u grows to %llu, bdp %llu", c->self,
+	    c->local_window_max, (unsigned long long)want,
+	    (unsigned long long)bdp);
+	return want - c->local_window_max;
+}
+
 static int
 channel_check_window(struct ssh *ssh, Channel *c)
 {
+	u_int grow;
 	int r;
 
 	if (c->type == SSH_CHANNEL_OPEN &&
@@ -2130,18 +2263,20 @@ channel_check_window(struct ssh *ssh, Channel *c)
 		if (!c->have_remote_id)
 			fatal(":%s: channel %d: no remote id",
 			    __func__, c->self);
+		grow = channel_window_growth(ssh, c);
 		if ((r = sshpkt_start(ssh,
 		    SSH2_MSG_CHANNEL_WINDOW_ADJUST)) != 0 ||
 		    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
-		    (r = sshpkt_put_u32(ssh, c->local_consumed)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, c->local_consumed + grow)) != 0 ||
 		    (r = sshpkt_send(ssh)) != 0) {
 			fatal("%s: channel %i: %s", __func__,
 			    c->self, ssh_err(r));
 		}
 		debug2("channel %d: window %d sent adjust %d",
 		    c->self, c->local_window,
-		    c->local_consumed);
-		c->local_window += c->local_consumed;
+		    c->local_consumed + grow);
+		c->local_window += c->local_consumed + grow;
+		c->local_window_max += grow;
 		c->local_consumed = 0;
 	}
 	return 1;
@@ -2623,6 +2758,12 @@ channel_output_poll(struct ssh *ssh)
 			continue;
 		}
 
+		/* Served in-process: the replies go out right away */
+		if (c->inproc != NULL) {
+			c->inproc(ssh, c->self, c->inproc_ctx);
+			channel_check_window(ssh, c);
+		}
+
 		/* Get the amount of buffered data for this channel. */
 		if (c->istate == CHAN_INPUT_OPEN ||
 		    c->istate == CHAN_INPUT_WAIT_DRAIN)
@@ -3247,6 +3388,32 @@ channel_set_af(struct ssh *ssh, int af)
 	ssh->chanctxt->IPv4or6 = af;
 }
 
+void
+channel_set_rbuf_max(struct ssh *ssh, u_int rbuf_max)
+{
+	ssh->chanctxt->rbuf_max = MAXIMUM(rbuf_max, CHAN_RBUF);
+}
+
+void
+channel_set_window_max(struct ssh *ssh, u_int window_max)
+{
+	ssh->chanctxt->window_max = window_max;
+}
+
+/* The receive window of channel 'id' grows with the traffic */
+void
+channel_tune_window(struct ssh *ssh, int id)
+{
+	Channel *c = channel_lookup(ssh, id);
+
+	if (c == NULL) {
+		logit("%s: %d: bad id", __func__, id);
+		return;
+	}
+	c->local_window_tune = 1;
+	c->local_tune_rtt = 0;
+}
+
 
 /*
  * Determine whether or not a port forward listens to loopback, the
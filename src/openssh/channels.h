@@ -150,6 +150,12 @@ struct Channel {
 	u_int	local_window_max;
 	u_int	local_consumed;
 	u_int	local_maxpacket;
+	u_int	rbuf_size;	/* current read size, adapted to the traffic */
+	/* receive window grown with the bandwidth-delay product */
+	int	local_window_tune;
+	double	local_tune_start;	/* start of the current measurement */
+	double	local_tune_rtt;		/* its round-trip time, 0 if none */
+	u_int64_t local_tune_bytes;	/* bytes received since the start */
 	int     extended_usage;
 	int	single_connection;
 
@@ -160,6 +166,10 @@ struct Channel {
 	void			*open_confirm_ctx;
 	channel_callback_fn	*detach_user;
 	int			detach_close;
+	/* served in-process: consumes output, and fills input directly */
+	channel_callback_fn	*inproc;
+	void			*inproc_ctx;
+	int			inproc_fd;	/* readable: replies are ready */
 	struct channel_confirms	status_confirms;
 
 	/* filter */
@@ -212,8 +222,12 @@ struct Channel {
 #define CHAN_EOF_RCVD			0x08
 #define CHAN_LOCAL			0x10
 
-/* Read buffer size */
+/* Read buffer size, and default ceiling of the adaptive read size */
 #define CHAN_RBUF	(16*1024)
+#define CHAN_RBUF_MAX	(16*CHAN_RBUF)
+
+/* Default ceiling of the autotuned session windows */
+#define CHAN_SES_WINDOW_MAX	(8*CHAN_SES_WINDOW_DEFAULT)
 
 /* Hard limit on number of channels */
 #define CHANNELS_MAX_CHANNELS	(16*1024)
@@ -252,6 +266,8 @@ void	 channel_register_open_confirm(struct ssh *, int,
 	    channel_open_fn *, void *);
 void	 channel_register_filter(struct ssh *, int, channel_infilter_fn *,
 	    channel_outfilter_fn *, channel_filter_cleanup_fn *, void *);
+void	 channel_register_inproc(struct ssh *, int, channel_callback_fn *,
+	    void *, int);
 void	 channel_register_status_confirm(struct ssh *, int,
 	    channel_confirm_cb *, channel_confirm_abandon_cb *, void *);
 void	 channel_cancel_cleanup(struct ssh *, int);
@@ -292,6 +308,9 @@ int	 channel_find_open(struct ssh *);
 struct Forward;
 struct ForwardOptions;
 void	 channel_set_af(struct ssh *, int af);
+void	 channel_set_rbuf_max(struct ssh *, u_int);
+void	 channel_set_window_max(struct ssh *, u_int);
+void	 channel_tune_window(struct ssh *, int);
 void     channel_permit_all(struct ssh *, int);
 void	 channel_add_permission(struct ssh *, int, int, char *, int);
 void	 channel_clear_permission(struct ssh *, int, int);
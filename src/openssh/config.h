@@ -463,6 +463,9 @@
 /* Define to 1 if you have the `explicit_bzero' function. */
 /* #undef HAVE_EXPLICIT_BZERO */
 
+/* Define to 1 if you have the `fallocate' function. */
+#define HAVE_FALLOCATE 1
+
 /* Define to 1 if you have the `fchmod' function. */
 #define HAVE_FCHMOD 1
 
@@ -912,6 +915,9 @@
 /* Define to 1 if you have the <poll.h> header file. */
 #define HAVE_POLL_H 1
 
+/* Define to 1 if you have the `posix_fadvise' function. */
+#define HAVE_POSIX_FADVISE 1
+
 /* Define to 1 if you have the `prctl' function. */
 #define HAVE_PRCTL 1
 
@@ -1111,6 +1117,9 @@
 /* Fields in struct sockaddr_storage */
 #define HAVE_SS_FAMILY_IN_SS 1
 
+/* Define to 1 if you have the `splice' function. */
+#define HAVE_SPLICE 1
+
 /* Define to 1 if you have the `statfs' function. */
 #define HAVE_STATFS 1
 
@@ -1234,6 +1243,9 @@
 /* Define to 1 if you have the `swap32' function. */
 /* #undef HAVE_SWAP32 */
 
+/* Define to 1 if you have the `sync_file_range' function. */
+#define HAVE_SYNC_FILE_RANGE 1
+
 /* Define to 1 if you have the `sysconf' function. */
 #define HAVE_SYSCONF 1
 
@@ -1261,6 +1273,9 @@
 /* Define if your system defines sys_errlist[] */
 #define HAVE_SYS_ERRLIST 1
 
+/* Define to 1 if you have the <sys/epoll.h> header file. */
+#define HAVE_SYS_EPOLL_H 1
+
 /* Define to 1 if you have the <sys/file.h> header file. */
 #define HAVE_SYS_FILE_H 1
 
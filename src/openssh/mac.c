@@ -163,16 +163,61 @@ mac_init(struct sshmac *mac)
 	}
 }
 
+/*
+ * A MAC computed in parts, for the data to be fed to it along with the
+ * cipher: mac_start(), then mac_update() for each part, then mac_finish()
+ * or mac_finish_check().
+ */
 int
-mac_compute(struct sshmac *mac, u_int32_t seqno,
-    const u_char *data, int datalen,
-    u_char *digest, size_t dlen)
+mac_start(struct sshmac *mac, u_int32_t seqno)
+{
+	u_char b[4];
+
+	switch (mac->type) {
+	case SSH_DIGEST:
+		put_u32(b, seqno);
+		/* reset HMAC context */
+		if (ssh_hmac_init(mac->hmac_ctx, NULL, 0) < 0 ||
+		    ssh_hmac_update(mac->hmac_ctx, b, sizeof(b)) < 0)
+			return SSH_ERR_LIBCRYPTO_ERROR;
+		break;
+	case SSH_UMAC:
+	case SSH_UMAC128:
+		/* the sequence number is the nonce, at the end */
+		break;
+	default:
+		return SSH_ERR_INVALID_ARGUMENT;
+	}
+	return 0;
+}
+
+int
+mac_update(struct sshmac *mac, const u_char *data, size_t datalen)
+{
+	switch (mac->type) {
+	case SSH_DIGEST:
+		if (ssh_hmac_update(mac->hmac_ctx, data, datalen) < 0)
+			return SSH_ERR_LIBCRYPTO_ERROR;
+		break;
+	case SSH_UMAC:
+		umac_update(mac->umac_ctx, data, datalen);
+		break;
+	case SSH_UMAC128:
+		umac128_update(mac->umac_ctx, data, datalen);
+		break;
+	default:
+		return SSH_ERR_INVALID_ARGUMENT;
+	}
+	return 0;
+}
+
+int
+mac_finish(struct sshmac *mac, u_int32_t seqno, u_char *digest, size_t dlen)
 {
 	static union {
 		u_char m[SSH_DIGEST_MAX_LENGTH];
 		u_int64_t for_align;
 	} u;
-	u_char b[4];
 	u_char nonce[8];
 
 	if (mac->mac_len > sizeof(u))
@@ -180,22 +225,15 @@ mac_compute(struct sshmac *mac, u_int32_t seqno,
 
 	switch (mac->type) {
 	case SSH_DIGEST:
-		put_u32(b, seqno);
-		/* reset HMAC context */
-		if (ssh_hmac_init(mac->hmac_ctx, NULL, 0) < 0 ||
-		    ssh_hmac_update(mac->hmac_ctx, b, sizeof(b)) < 0 ||
-		    ssh_hmac_update(mac->hmac_ctx, data, datalen) < 0 ||
-		    ssh_hmac_final(mac->hmac_ctx, u.m, sizeof(u.m)) < 0)
+		if (ssh_hmac_final(mac->hmac_ctx, u.m, sizeof(u.m)) < 0)
 			return SSH_ERR_LIBCRYPTO_ERROR;
 		break;
 	case SSH_UMAC:
 		POKE_U64(nonce, seqno);
-		umac_update(mac->umac_ctx, data, datalen);
 		umac_final(mac->umac_ctx, u.m, nonce);
 		break;
 	case SSH_UMAC128:
 		put_u64(nonce, seqno);
-		umac128_update(mac->umac_ctx, data, datalen);
 		umac128_final(mac->umac_ctx, u.m, nonce);
 		break;
 	default:
@@ -210,8 +248,7 @@ mac_compute(struct sshmac *mac, u_int32_t seqno,
 }
 
 int
-mac_check(struct sshmac *mac, u_int32_t seqno,
-    const u_char *data, size_t dlen,
+mac_finish_check(struct sshmac *mac, u_int32_t seqno,
     const u_char *theirmac, size_t mlen)
 {
 	u_char ourmac[SSH_DIGEST_MAX_LENGTH];
@@ -219,14 +256,41 @@ mac_check(struct sshmac *mac, u_int32_t seqno,
 
 	if (mac->mac_len > mlen)
 		return SSH_ERR_INVALID_ARGUMENT;
-	if ((r = mac_compute(mac, seqno, data, dlen,
-	    ourmac, sizeof(ourmac))) != 0)
+	if ((r = mac_finish(mac, seqno, ourmac, sizeof(ourmac))) != 0)
 		return r;
 	if (timingsafe_bcmp(ourmac, theirmac, mac->mac_len) != 0)
 		return SSH_ERR_MAC_INVALID;
 	return 0;
 }
 
+int
+mac_compute(struct sshmac *mac, u_int32_t seqno,
+    const u_char *data, int datalen,
+    u_char *digest, size_t dlen)
+{
+	int r;
+
+	if ((r = mac_start(mac, seqno)) != 0 ||
+	    (r = mac_update(mac, data, datalen)) != 0)
+		return r;
+	return mac_finish(mac, seqno, digest, dlen);
+}
+
+int
+mac_check(struct sshmac *mac, u_int32_t seqno,
+    const u_char *data, size_t dlen,
+    const u_char *theirmac, size_t mlen)
+{
+	int r;
+
+	if (mac->mac_len > mlen)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if ((r = mac_start(mac, seqno)) != 0 ||
+	    (r = mac_update(mac, data, dlen)) != 0)
+		return r;
+	return mac_finish_check(mac, seqno, theirmac, mlen);
+}
+
 void
 mac_clear(struct sshmac *mac)
 {
@@ -48,6 +48,10 @@ int	 mac_compute(struct sshmac *, u_int32_t, const u_char *, int,
     u_char *, size_t);
 int	 mac_check(struct sshmac *, u_int32_t, const u_char *, size_t,
     const u_char *, size_t);
+int	 mac_start(struct sshmac *, u_int32_t);
+int	 mac_update(struct sshmac *, const u_char *, size_t);
+int	 mac_finish(struct sshmac *, u_int32_t, u_char *, size_t);
+int	 mac_finish_check(struct sshmac *, u_int32_t, const u_char *, size_t);
 void	 mac_clear(struct sshmac *);
 
 #endif /* SSHMAC_H */
@@ -1020,6 +1020,37 @@ ssh_packet_log_type(u_char type)
 	}
 }
 
+/*
+ * Encrypts or decrypts like cipher_crypt(), for ciphers without their
+ * own authentication, and feeds the MAC started by the caller in the
+ * same pass: one slice at a time, while it is in the cache, with the
+ * input if 'mac_src', otherwise with the output.
+ */
+#define PACKET_CRYPT_SLICE	(8 * 1024)	/* a multiple of all blocks */
+
+static int
+packet_crypt_mac(struct sshcipher_ctx *cc, u_int seqnr, u_char *dest,
+    const u_char *src, u_int len, u_int aadlen, struct sshmac *mac,
+    int mac_src)
+{
+	u_int off = 0, n;
+	int r;
+
+	do {
+		n = MINIMUM(len - off, PACKET_CRYPT_SLICE);
+		if ((r = cipher_crypt(cc, seqnr, dest, src, n,
+		    aadlen, 0)) != 0 ||
+		    (r = mac_update(mac, mac_src ? src : dest,
+		    aadlen + n)) != 0)
+			return r;
+		dest += aadlen + n;
+		src += aadlen + n;
+		off += n;
+		aadlen = 0;
+	} while (off < len);
+	return 0;
+}
+
 /*
  * Finalize packet in SSH2 format (compress, mac, encrypt, enqueue)
  */
@@ -1128,35 +1159,32 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 	DBG(debug("send: len %d (includes padlen %d, aadlen %d)",
 	    len, padlen, aadlen));
 
-	/* compute MAC over seqnr and packet(length fields, payload, padding) */
-	if (mac && mac->enabled && !mac->etm) {
-		if ((r = mac_compute(mac, state->p_send.seqnr,
-		    sshbuf_ptr(state->outgoing_packet), len,
-		    macbuf, sizeof(macbuf))) != 0)
-			goto out;
-		DBG(debug("done calc MAC out #%d", state->p_send.seqnr));
-	}
 	/* encrypt packet and append to output buffer. */
 	if ((r = sshbuf_reserve(state->output,
 	    sshbuf_len(state->outgoing_packet) + authlen, &cp)) != 0)
 		goto out;
-	if ((r = cipher_crypt(state->send_context, state->p_send.seqnr, cp,
-	    sshbuf_ptr(state->outgoing_packet),
-	    len - aadlen, aadlen, authlen)) != 0)
-		goto out;
-	/* append unencrypted MAC */
 	if (mac && mac->enabled) {
-		if (mac->etm) {
-			/* EtM: compute mac over aadlen + cipher text */
-			if ((r = mac_compute(mac, state->p_send.seqnr,
-			    cp, len, macbuf, sizeof(macbuf))) != 0)
-				goto out;
-			DBG(debug("done calc MAC(EtM) out #%d",
-			    state->p_send.seqnr));
-		}
+		/*
+		 * MAC over seqnr and packet(length fields, payload, padding),
+		 * or EtM: over aadlen + cipher text
+		 */
+		if ((r = mac_start(mac, state->p_send.seqnr)) != 0 ||
+		    (r = packet_crypt_mac(state->send_context,
+		    state->p_send.seqnr, cp,
+		    sshbuf_ptr(state->outgoing_packet), len - aadlen, aadlen,
+		    mac, !mac->etm)) != 0 ||
+		    (r = mac_finish(mac, state->p_send.seqnr,
+		    macbuf, sizeof(macbuf))) != 0)
+			goto out;
+		DBG(debug("done calc MAC%s out #%d", mac->etm ? "(EtM)" : "",
+		    state->p_send.seqnr));
+		/* append unencrypted MAC */
 		if ((r = sshbuf_put(state->output, macbuf, mac->mac_len)) != 0)
 			goto out;
-	}
+	} else if ((r = cipher_crypt(state->send_context,
+	    state->p_send.seqnr, cp, sshbuf_ptr(state->outgoing_packet),
+	    len - aadlen, aadlen, authlen)) != 0)
+		goto out;
 #ifdef PACKET_DEBUG
 	fprintf(stderr, "encrypted: ");
 	sshbuf_dump(state->output, stderr);
@@ -1567,16 +1595,24 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 	if ((r = sshbuf_reserve(state->incoming_packet, aadlen + need,
 	    &cp)) != 0)
 		goto out;
-	if ((r = cipher_crypt(state->receive_context, state->p_read.seqnr, cp,
-	    sshbuf_ptr(state->input), need, aadlen, authlen)) != 0)
+	if (mac && mac->enabled && !mac->etm) {
+		/* Not EtM: MAC over cleartext, the first block included */
+		if ((r = mac_start(mac, state->p_read.seqnr)) != 0 ||
+		    (r = mac_update(mac,
+		    sshbuf_ptr(state->incoming_packet), block_size)) != 0 ||
+		    (r = packet_crypt_mac(state->receive_context,
+		    state->p_read.seqnr, cp, sshbuf_ptr(state->input),
+		    need, aadlen, mac, 0)) != 0)
+			goto out;
+	} else if ((r = cipher_crypt(state->receive_context,
+	    state->p_read.seqnr, cp, sshbuf_ptr(state->input),
+	    need, aadlen, authlen)) != 0)
 		goto out;
 	if ((r = sshbuf_consume(state->input, aadlen + need + authlen)) != 0)
 		goto out;
 	if (mac && mac->enabled) {
 		/* Not EtM: check MAC over cleartext */
-		if (!mac->etm && (r = mac_check(mac, state->p_read.seqnr,
-		    sshbuf_ptr(state->incoming_packet),
-		    sshbuf_len(state->incoming_packet),
+		if (!mac->etm && (r = mac_finish_check(mac, state->p_read.seqnr,
 		    sshbuf_ptr(state->input), maclen)) != 0) {
 			if (r != SSH_ERR_MAC_INVALID)
 				goto out;
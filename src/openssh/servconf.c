@@ -179,6 +179,9 @@ initialize_server_options(ServerOptions *options)
 	options->fingerprint_hash = -1;
 	options->disable_forwarding = -1;
 	options->expose_userauth_info = -1;
+	options->channel_buffer_size = -1;
+	options->channel_window_max = -1;
+	options->in_process_sftp = -1;
 }
 
 /* Returns 1 if a string option is unset or set to "none" or 0 otherwise. */
@@ -407,6 +410,12 @@ fill_default_server_options(ServerOptions *options)
 		options->disable_forwarding = 0;
 	if (options->expose_userauth_info == -1)
 		options->expose_userauth_info = 0;
+	if (options->channel_buffer_size == -1)
+		options->channel_buffer_size = CHAN_RBUF_MAX;
+	if (options->channel_window_max == -1)
+		options->channel_window_max = CHAN_SES_WINDOW_MAX;
+	if (options->in_process_sftp == -1)
+		options->in_process_sftp = 0;
 
 	assemble_algorithms(options);
 
@@ -492,7 +501,8 @@ typedef enum {
 	sAuthenticationMethods, sHostKeyAgent, sPermitUserRC,
 	sStreamLocalBindMask, sStreamLocalBindUnlink,
 	sAllowStreamLocalForwarding, sFingerprintHash, sDisableForwarding,
-	sExposeAuthInfo, sRDomain,
+	sExposeAuthInfo, sRDomain, sChannelBufferSize, sInProcessSftp,
+	sChannelWindowMax,
 	sDeprecated, sIgnore, sUnsupported
 } ServerOpCodes;
 
@@ -640,6 +650,9 @@ static struct {
 	{ "disableforwarding", sDisableForwarding, SSHCFG_ALL },
 	{ "exposeauthinfo", sExposeAuthInfo, SSHCFG_ALL },
 	{ "rdomain", sRDomain, SSHCFG_ALL },
+	{ "channelbuffersize", sChannelBufferSize, SSHCFG_GLOBAL },
+	{ "inprocesssftp", sInProcessSftp, SSHCFG_GLOBAL },
+	{ "channelwindowmax", sChannelWindowMax, SSHCFG_GLOBAL },
 	{ NULL, sBadOption, 0 }
 };
 
@@ -2126,6 +2139,42 @@ process_server_config_line(ServerOptions *options, char *line,
 		intptr = &options->expose_userauth_info;
 		goto parse_flag;
 
+	case sInProcessSftp:
+		intptr = &options->in_process_sftp;
+		goto parse_flag;
+
+	case sChannelBufferSize:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%.200s line %d: Missing argument.", filename,
+			    linenum);
+		if (scan_scaled(arg, &val64) == -1)
+			fatal("%.200s line %d: Bad number '%s': %s",
+			    filename, linenum, arg, strerror(errno));
+		if (val64 < CHAN_RBUF || val64 > 64 * 1024 * 1024)
+			fatal("%.200s line %d: ChannelBufferSize out of range",
+			    filename, linenum);
+		if (*activep && options->channel_buffer_size == -1)
+			options->channel_buffer_size = (int)val64;
+		break;
+
+	case sChannelWindowMax:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%.200s line %d: Missing argument.", filename,
+			    linenum);
+		if (scan_scaled(arg, &val64) == -1)
+			fatal("%.200s line %d: Bad number '%s': %s",
+			    filename, linenum, arg, strerror(errno));
+		/* The channel buffers must hold a whole window */
+		if (val64 < CHAN_SES_WINDOW_DEFAULT ||
+		    val64 > 64 * 1024 * 1024)
+			fatal("%.200s line %d: ChannelWindowMax out of range",
+			    filename, linenum);
+		if (*activep && options->channel_window_max == -1)
+			options->channel_window_max = (int)val64;
+		break;
+
 	case sRDomain:
 		charptr = &options->routing_domain;
 		arg = strdelim(&cp);
@@ -2529,6 +2578,8 @@ dump_config(ServerOptions *o)
 	dump_cfg_int(sX11DisplayOffset, o->x11_display_offset);
 	dump_cfg_int(sMaxAuthTries, o->max_authtries);
 	dump_cfg_int(sMaxSessions, o->max_sessions);
+	dump_cfg_int(sChannelBufferSize, o->channel_buffer_size);
+	dump_cfg_int(sChannelWindowMax, o->channel_window_max);
 	dump_cfg_int(sClientAliveInterval, o->client_alive_interval);
 	dump_cfg_int(sClientAliveCountMax, o->client_alive_count_max);
 	dump_cfg_oct(sStreamLocalBindMask, o->fwd_opts.streamlocal_bind_mask);
@@ -2579,6 +2630,7 @@ dump_config(ServerOptions *o)
 	dump_cfg_fmtint(sStreamLocalBindUnlink, o->fwd_opts.streamlocal_bind_unlink);
 	dump_cfg_fmtint(sFingerprintHash, o->fingerprint_hash);
 	dump_cfg_fmtint(sExposeAuthInfo, o->expose_userauth_info);
+	dump_cfg_fmtint(sInProcessSftp, o->in_process_sftp);
 
 	/* string arguments */
 	dump_cfg_string(sPidFile, o->pid_file);
@@ -208,6 +208,9 @@ typedef struct {
 
 	int	fingerprint_hash;
 	int	expose_userauth_info;
+	int	channel_buffer_size;	/* ceiling of the adaptive buffers */
+	int	channel_window_max;	/* ceiling of the autotuned windows */
+	int	in_process_sftp;	/* internal-sftp without a child */
 	u_int64_t timing_secret;
 }       ServerOptions;
 
@@ -397,6 +397,8 @@ server_loop2(struct ssh *ssh, Authctxt *authctxt)
 	}
 
 	notify_setup();
+	channel_set_rbuf_max(ssh, options.channel_buffer_size);
+	channel_set_window_max(ssh, options.channel_window_max);
 
 	max_fd = MAXIMUM(connection_in, connection_out);
 	max_fd = MAXIMUM(max_fd, notify_pipe[0]);
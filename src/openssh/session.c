@@ -97,6 +97,8 @@
 #include "sftp.h"
 #include "atomicio.h"
 
+#include "mq-config.h"
+
 #if defined(KRB5) && defined(USE_AFS)
 #include <kafs.h>
 #endif
@@ -120,6 +122,9 @@ void	session_proctitle(Session *);
 int	session_setup_x11fwd(struct ssh *, Session *);
 int	do_exec_pty(struct ssh *, Session *, const char *);
 int	do_exec_no_pty(struct ssh *, Session *, const char *);
+static int do_exec_sftp_inproc(struct ssh *, Session *, const char *);
+static void session_sftp_stop(void);
+static void session_exit_message(struct ssh *, Session *, int);
 int	do_exec(struct ssh *, Session *, const char *);
 void	do_login(struct ssh *, Session *, const char *);
 void	do_child(struct ssh *, Session *, const char *);
@@ -164,6 +169,9 @@ login_cap_t *lc;
 static int is_child = 0;
 static int in_chroot = 0;
 
+/* The session served by internal-sftp in this process, if any */
+static Session *sftp_inproc = NULL;
+
 /* File containing userauth info, if ExposeAuthInfo set */
 static char *auth_info_file = NULL;
 
@@ -384,6 +392,20 @@ xauth_valid_string(const char *s)
 }
 
 #define USE_PIPES 1
+
+#ifdef USE_PIPES
+/* Pipes to the program as large as the channel buffers */
+static void
+session_set_pipe_size(int fd)
+{
+#ifdef F_SETPIPE_SZ
+	if (fcntl(fd, F_SETPIPE_SZ, options.channel_buffer_size) == -1)
+		debug("%s: F_SETPIPE_SZ %d: %s", __func__,
+		    options.channel_buffer_size, strerror(errno));
+#endif
+}
+#endif
+
 /*
  * This is called to fork and execute a command when we have no tty.  This
  * will call do_child from the child, and server_loop from the parent after
@@ -419,6 +441,8 @@ do_exec_no_pty(struct ssh *ssh, Session *s, const char *command)
 		close(pout[1]);
 		return -1;
 	}
+	session_set_pipe_size(pin[1]);
+	session_set_pipe_size(pout[0]);
 #else
 	int inout[2], err[2];
 
@@ -751,6 +775,12 @@ do_exec(struct ssh *ssh, Session *s, const char *command)
 #endif
 	if (s->ttyfd != -1)
 		ret = do_exec_pty(ssh, s, command);
+#ifndef WITH_SELINUX
+	else if (s->is_subsystem == SUBSYSTEM_INT_SFTP &&
+	    options.in_process_sftp && use_privsep && geteuid() != 0 &&
+	    sftp_inproc == NULL)
+		ret = do_exec_sftp_inproc(ssh, s, command);
+#endif
 	else
 		ret = do_exec_no_pty(ssh, s, command);
 
@@ -1518,9 +1548,104 @@ child_close_fds(struct ssh *ssh)
 	 * Close any extra open file descriptors so that we don't have them
 	 * hanging around in clients.  Note that we want to do this after
 	 * initgroups, because at least on Solaris 2.3 it leaves file
-	 * descriptors open.
+	 * descriptors open.  The MQ spool must survive the chroot.
 	 */
-	closefrom(STDERR_FILENO + 1);
+	closefrom(mq_preserve_fds(STDERR_FILENO + 1));
+}
+
+#define ARGV_MAX 10
+#define SFTP_ARGV_MAX (ARGV_MAX + 2)	/* room for -b <size> */
+
+/* Splits the internal-sftp command line into argv */
+static int
+internal_sftp_args(const char *command, char **argv)
+{
+	static char input_size[32];
+	char *p, *args;
+	int i;
+
+	args = xstrdup(command ? command : "sftp-server");
+	snprintf(input_size, sizeof(input_size), "%d",
+	    options.channel_buffer_size);
+	for (i = 0, (p = strtok(args, " ")); p; (p = strtok(NULL, " "))) {
+		if (i < SFTP_ARGV_MAX - 1)
+			argv[i++] = p;
+		else
+			logit("%s: too many arguments, \"%s\" ignored",
+			    INTERNAL_SFTP_NAME, p);
+		/* Reads as large as the channel's, unless overridden */
+		if (i == 1) {
+			argv[i++] = "-b";
+			argv[i++] = input_size;
+		}
+	}
+	argv[i] = NULL;
+	return i;
+}
+
+/* Serves the requests received on the channel of the in-process sftp */
+static void
+session_sftp_input(struct ssh *ssh, int id, void *arg)
+{
+	Session *s = arg;
+	Channel *c;
+
+	if (s != sftp_inproc || (c = channel_lookup(ssh, id)) == NULL)
+		return;
+	if (!sftp_server_input(c->output, c->input, &c->local_consumed) ||
+	    c->ostate == CHAN_OUTPUT_OPEN)
+		return;
+
+	/* EOF from the client, all served: as if sftp-server exited */
+	channel_register_inproc(ssh, id, NULL, NULL, -1);
+	session_sftp_stop();
+	session_exit_message(ssh, s, 0);
+	chan_read_failed(ssh, c);
+}
+
+static void
+session_sftp_stop(void)
+{
+	if (sftp_inproc == NULL)
+		return;
+	sftp_inproc = NULL;
+	sftp_server_stop();
+}
+
+/*
+ * internal-sftp without a child: the channel data goes straight to the
+ * request handlers, and the replies straight to the channel. Only when
+ * this process already runs as the user, in the chroot if any, as
+ * with privilege separation, and for one session at a time.
+ *
+ * Off by default (InProcessSftp): whatever blocks in a request handler,
+ * such as the checksum read-back at close, check-file hashing or
+ * synchronous writes to slow storage, blocks the whole connection, and
+ * sftp's umask and working directory are the session process's own.
+ */
+static int
+do_exec_sftp_inproc(struct ssh *ssh, Session *s, const char *command)
+{
+	extern int optind, optreset;
+	char *argv[SFTP_ARGV_MAX];
+	int argc;
+
+	if (s->chanid == -1)
+		fatal("%s: no channel for session %d", __func__, s->self);
+	debug("%s: session %d served in-process", __func__, s->self);
+
+	if (chdir(s->pw->pw_dir) < 0)
+		debug("%s: chdir to %s: %s", __func__, s->pw->pw_dir,
+		    strerror(errno));
+	argc = internal_sftp_args(command, argv);
+	optind = optreset = 1;
+	sftp_server_start(argc, argv, s->pw, ssh_remote_ipaddr(ssh));
+
+	session_set_fds(ssh, s, -1, -1, -1, 1, 0);
+	channel_register_inproc(ssh, s->chanid, session_sftp_input, s,
+	    sftp_server_wakeup_fd());
+	sftp_inproc = s;
+	return 0;
 }
 
 /*
@@ -1528,13 +1653,12 @@ child_close_fds(struct ssh *ssh)
  * environment, closing extra file descriptors, setting the user and group
  * ids, and executing the command or shell.
  */
-#define ARGV_MAX 10
 void
 do_child(struct ssh *ssh, Session *s, const char *command)
 {
 	extern char **environ;
 	char **env;
-	char *argv[ARGV_MAX];
+	char *argv[SFTP_ARGV_MAX];
 	const char *shell, *shell0;
 	struct passwd *pw = s->pw;
 	int r = 0;
@@ -1653,7 +1777,7 @@ do_child(struct ssh *ssh, Session *s, const char *command)
 			exit(1);
 	}
 
-	closefrom(STDERR_FILENO + 1);
+	closefrom(mq_preserve_fds(STDERR_FILENO + 1));
 
 	do_rc_files(ssh, s, shell);
 
@@ -1667,14 +1791,9 @@ do_child(struct ssh *ssh, Session *s, const char *command)
 	} else if (s->is_subsystem == SUBSYSTEM_INT_SFTP) {
 		extern int optind, optreset;
 		int i;
-		char *p, *args;
 
 		setproctitle("%s@%s", s->pw->pw_name, INTERNAL_SFTP_NAME);
-		args = xstrdup(command ? command : "sftp-server");
-		for (i = 0, (p = strtok(args, " ")); p; (p = strtok(NULL, " ")))
-			if (i < ARGV_MAX - 1)
-				argv[i++] = p;
-		argv[i] = NULL;
+		i = internal_sftp_args(command, argv);
 		optind = optreset = 1;
 		__progname = argv[0];
 #ifdef WITH_SELINUX
@@ -2176,6 +2295,7 @@ session_set_fds(struct ssh *ssh, Session *s,
 	    fdout, fdin, fderr,
 	    ignore_fderr ? CHAN_EXTENDED_IGNORE : CHAN_EXTENDED_READ,
 	    1, is_tty, CHAN_SES_WINDOW_DEFAULT);
+	channel_tune_window(ssh, s->chanid);
 }
 
 /*
@@ -2352,6 +2472,9 @@ session_close(struct ssh *ssh, Session *s)
 	    ssh_remote_port(ssh),
 	    s->self);
 
+	if (s == sftp_inproc)
+		session_sftp_stop();
+
 	if (s->ttyfd != -1)
 		session_pty_cleanup(s);
 	free(s->term);
@@ -2577,6 +2700,10 @@ do_cleanup(struct ssh *ssh, Authctxt *authctxt)
 		return;
 	called = 1;
 
+	/* Open files and pending notifications of the in-process sftp */
+	session_sftp_stop();
+	sftp_server_exit();
+
 	if (authctxt == NULL)
 		return;
 
@@ -19,6 +19,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
 #endif
@@ -39,8 +40,14 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "xmalloc.h"
+#include "atomicio.h"
 #include "sshbuf.h"
 #include "ssherr.h"
 #include "log.h"
@@ -50,6 +57,7 @@
 
 #include "sftp.h"
 #include "sftp-common.h"
+#include "openbsd-compat/sys-queue.h"
 
 #include "mq-config.h"
 #include "mq-checksum.h"
@@ -67,6 +75,69 @@ static char *client_addr = NULL;
 struct sshbuf *iqueue;
 struct sshbuf *oqueue;
 
+/*
+ * Bytes read from the client at once, straight into iqueue: this grows
+ * while the reads fill it, up to max_input, and shrinks back when they
+ * get small.
+ */
+#define SFTP_INPUT_CHUNK	(64 * 1024)
+#define SFTP_MAX_INPUT		(64 * 1024 * 1024)
+static u_int input_chunk = SFTP_INPUT_CHUNK;
+static u_int max_input = SFTP_INPUT_CHUNK;
+
+/* Bytes of the following packets consumed along with the current one */
+static u_int iqueue_extra;
+/* Bytes left in iqueue after the current packet */
+static u_int iqueue_rest;
+
+/* Adjacent writes to the same handle, done with one pwritev */
+#define SFTP_WRITE_COALESCE	16
+
+/*
+ * Sequential streams: reads are prefetched in a window growing up to
+ * SFTP_READ_AHEAD_MAX, and writes sent to the disk every
+ * SFTP_WRITE_BEHIND bytes, the previous batch waited for.
+ */
+#define SFTP_READ_AHEAD_MIN	(256 * 1024)
+#define SFTP_READ_AHEAD_MAX	(8 * 1024 * 1024)
+#define SFTP_WRITE_BEHIND	(8 * 1024 * 1024)
+/* Uploads past this size leave the page cache once written (-W), or 0 */
+static u_int64_t drop_behind;
+
+/*
+ * Uploads are allocated ahead of their writes, in extents growing with
+ * the file, for it to be laid out contiguously. The blocks left past
+ * the end are given back on close.
+ */
+#define SFTP_PREALLOC_MIN	(4 * 1024 * 1024)
+#define SFTP_PREALLOC_MAX	(1024 * 1024 * 1024)
+#define SFTP_NO_PREALLOC	((u_int64_t)-1)
+
+/* Largest read reply, and its buffer */
+#define SFTP_DEFAULT_READ	(64 * 1024)
+#define SFTP_MAX_READ		(SFTP_MAX_MSG_LENGTH - 1024)
+static u_int max_read = SFTP_DEFAULT_READ;
+static u_char *read_buf;
+
+/* Served inside the sshd session process, straight from its channel */
+static int inproc, inproc_used;
+#define SFTP_INPROC_OUTPUT	(4 * SFTP_MAX_MSG_LENGTH)
+
+/* Writes done by a separate thread (-A), and the bytes they may hold */
+static int async_io;
+#define SFTP_ASYNC_MAX_BYTES	(16 * 1024 * 1024)
+/* Polls for the replies while writes are in flight, in case of no wake-up */
+#define SFTP_ASYNC_POLL_MS	1000
+
+/*
+ * Reads spliced from the file to stdout, when it is a blocking pipe.
+ * The data goes through a pipe of our own first, for its length to be
+ * known before the reply header.
+ */
+#define SFTP_SPLICE_MIN		(16 * 1024)
+static int splice_pipe[2] = { -1, -1 };
+static int splice_out = -1;
+
 /* Version of client */
 static u_int version;
 
@@ -112,8 +183,12 @@ static void process_extended_statvfs(u_int32_t id);
 static void process_extended_fstatvfs(u_int32_t id);
 static void process_extended_hardlink(u_int32_t id);
 static void process_extended_fsync(u_int32_t id);
+static void process_extended_check_file_handle(u_int32_t id);
+static void process_extended_check_file_name(u_int32_t id);
 static void process_extended(u_int32_t id);
 
+static void async_collect(int wait);
+
 struct sftp_handler {
 	const char *name;	/* user-visible name for fine-grained perms */
 	const char *ext_name;	/* extended request name */
@@ -153,6 +228,10 @@ struct sftp_handler extended_handlers[] = {
 	{ "fstatvfs", "fstatvfs@openssh.com", 0, process_extended_fstatvfs, 0 },
 	{ "hardlink", "hardlink@openssh.com", 0, process_extended_hardlink, 1 },
 	{ "fsync", "fsync@openssh.com", 0, process_extended_fsync, 1 },
+	{ "check-file-handle", "check-file-handle", 0,
+	   process_extended_check_file_handle, 0 },
+	{ "check-file-name", "check-file-name", 0,
+	   process_extended_check_file_name, 0 },
 	{ NULL, NULL, 0, NULL, 0 }
 };
 
@@ -281,6 +360,10 @@ struct Handle {
 	int flags;
 	char *name;
 	u_int64_t bytes_read, bytes_write;
+	u_int64_t ra_next, ra_end;	/* next sequential read, prefetched */
+	u_int32_t ra_window;
+	u_int64_t wb_next, wb_start, wb_prev; /* written, queued, in flight */
+	u_int64_t alloc_end;		/* or SFTP_NO_PREALLOC */
 	int next_unused;
         checksum_t md;
 };
@@ -324,6 +407,10 @@ handle_new(int use, const char *name, int fd, int flags, DIR *dirp)
 	handles[i].flags = flags;
 	handles[i].name = xstrdup(name);
 	handles[i].bytes_read = handles[i].bytes_write = 0;
+	handles[i].ra_next = handles[i].ra_end = 0;
+	handles[i].ra_window = 0;
+	handles[i].wb_next = handles[i].wb_start = handles[i].wb_prev = 0;
+	handles[i].alloc_end = SFTP_NO_PREALLOC;
 	/* handles[i].md = malloc(sizeof(checksum_t)); */
 
 	return i;
@@ -407,11 +494,160 @@ handle_update_write(int handle, ssize_t bytes)
 		handles[handle].bytes_write += bytes;
 }
 
+/* Before a read: keeps the data of sequential reads coming */
+static void
+handle_read_ahead(int handle, u_int64_t off, u_int32_t len)
+{
+#ifdef HAVE_POSIX_FADVISE
+	Handle *h;
+	u_int64_t start;
+
+	if (!handle_is_ok(handle, HANDLE_FILE))
+		return;
+	h = &handles[handle];
+	if (off != h->ra_next) {
+		/* Not sequential: the kernel's own read-ahead will do */
+		h->ra_next = off + len;
+		h->ra_end = 0;
+		h->ra_window = 0;
+		return;
+	}
+	h->ra_next = off + len;
+	if (h->ra_window == 0)
+		h->ra_window = SFTP_READ_AHEAD_MIN;
+	if (h->ra_end >= h->ra_next + h->ra_window / 2)
+		return;		/* still far enough ahead */
+	start = MAXIMUM(h->ra_end, h->ra_next);
+	if (posix_fadvise(h->fd, start, h->ra_window,
+	    POSIX_FADV_WILLNEED) != 0)
+		return;
+	h->ra_end = start + h->ra_window;
+	h->ra_window = MINIMUM(h->ra_window * 2, SFTP_READ_AHEAD_MAX);
+#endif
+}
+
+/*
+ * After a write: the dirty pages of a sequential upload are written out
+ * in the background, and bounded to two batches. Also called from the
+ * asynchronous writer.
+ */
+static void
+handle_write_behind(int handle, u_int64_t off, ssize_t len)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+	Handle *h;
+	u_int64_t end;
+
+	if (!handle_is_ok(handle, HANDLE_FILE) || len <= 0)
+		return;
+	h = &handles[handle];
+	if (off != h->wb_next)		/* not sequential: start over */
+		h->wb_start = h->wb_prev = off;
+	h->wb_next = off + len;
+	end = h->wb_next - h->wb_next % SFTP_WRITE_BEHIND;
+	if (end <= h->wb_start)
+		return;
+	if (sync_file_range(h->fd, h->wb_start, end - h->wb_start,
+	    SYNC_FILE_RANGE_WRITE) != 0)
+		return;
+	if (h->wb_prev < h->wb_start &&
+	    sync_file_range(h->fd, h->wb_prev, h->wb_start - h->wb_prev,
+	    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+	    SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+		return;
+#ifdef HAVE_POSIX_FADVISE
+	/* On the disk now: the pages can go */
+	if (drop_behind > 0 && h->wb_next >= drop_behind)
+		posix_fadvise(h->fd, h->wb_prev, h->wb_start - h->wb_prev,
+		    POSIX_FADV_DONTNEED);
+#endif
+	h->wb_prev = h->wb_start;
+	h->wb_start = end;
+#endif
+}
+
+/* Before a write up to 'end': allocates the next extent if needed */
 static void
-handle_update_checksum(int handle, u_char *data, int len)
+handle_preallocate(int handle, u_int64_t off, u_int64_t end)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	Handle *h;
+	u_int64_t start, len;
+
+	if (!handle_is_ok(handle, HANDLE_FILE))
+		return;
+	h = &handles[handle];
+	if (h->alloc_end == SFTP_NO_PREALLOC || end <= h->alloc_end)
+		return;
+	start = MAXIMUM(h->alloc_end, off);
+	len = MINIMUM(MAXIMUM(start, SFTP_PREALLOC_MIN), SFTP_PREALLOC_MAX);
+	len = MAXIMUM(len, MINIMUM(end - start, SFTP_PREALLOC_MAX));
+	/* The size stays that of the data: resumes start from there */
+	if (fallocate(h->fd, FALLOC_FL_KEEP_SIZE, start, len) != 0) {
+		/* e.g. NFSv3, or a full disk the write will report */
+		debug("%s: fallocate \"%s\": %s", __func__, h->name,
+		    strerror(errno));
+		h->alloc_end = SFTP_NO_PREALLOC;
+		return;
+	}
+	debug3("%s: \"%s\" allocated up to %llu", __func__, h->name,
+	    (unsigned long long)(start + len));
+	h->alloc_end = start + len;
+#endif
+}
+
+/* On close: drops a large upload from the page cache, tail included */
+static void
+handle_drop_behind(Handle *h, off_t size)
+{
+#if defined(HAVE_SYNC_FILE_RANGE) && defined(HAVE_POSIX_FADVISE)
+	if (drop_behind == 0 || (u_int64_t)size < drop_behind)
+		return;
+	if (sync_file_range(h->fd, h->wb_prev, 0,
+	    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+	    SYNC_FILE_RANGE_WAIT_AFTER) != 0 ||
+	    posix_fadvise(h->fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+		debug("%s: \"%s\": %s", __func__, h->name, strerror(errno));
+#endif
+}
+
+/* Gives back what was allocated past the end of the file */
+static void
+handle_trim(Handle *h, const struct stat *st)
+{
+	struct timeval tv[2];
+
+	if (h->alloc_end == SFTP_NO_PREALLOC ||
+	    h->alloc_end <= (u_int64_t)st->st_size)
+		return;
+	/* Punching holes stops at the end of the file, truncating does not */
+	if (ftruncate(h->fd, st->st_size) != 0) {
+		debug("%s: ftruncate \"%s\": %s", __func__, h->name,
+		    strerror(errno));
+		return;
+	}
+	/* Same size, so keep the times the client saw or set */
+	tv[0].tv_sec = st->st_atim.tv_sec;
+	tv[0].tv_usec = st->st_atim.tv_nsec / 1000;
+	tv[1].tv_sec = st->st_mtim.tv_sec;
+	tv[1].tv_usec = st->st_mtim.tv_nsec / 1000;
+	if (futimes(h->fd, tv) != 0)
+		debug("%s: futimes \"%s\": %s", __func__, h->name,
+		    strerror(errno));
+}
+
+static void
+handle_update_checksum(int handle, u_int64_t off, const u_char *data, int len)
 {
         if (handle_is_ok(handle, HANDLE_FILE) && len > 0)
-	        checksum_add(&(handles[handle].md), data, len);
+	        checksum_update(&(handles[handle].md), off, data, len);
+}
+
+static void
+handle_truncate_checksum(int handle, u_int64_t size)
+{
+        if (handle_is_ok(handle, HANDLE_FILE))
+	        checksum_truncate(&(handles[handle].md), size);
 }
 
 static u_int64_t
@@ -438,17 +674,23 @@ handle_close(int handle)
 	if (handle_is_ok(handle, HANDLE_FILE)) {
 	        Handle h = handles[handle];
 		struct stat st;
-		fstat(h.fd, &st);
+		checksum_digests_t digests;
+		int upload = (h.flags & (O_CREAT|O_TRUNC|O_APPEND)) /* Create or Truncate or Append: (re)upload */
+		             && (h.flags & O_ACCMODE) != O_RDONLY; /* not Read-Only */
+
+		/* Trimmed first: the saved checksum state and the message carry the final mtime */
+		if (fstat(h.fd, &st) == 0)
+			handle_trim(&h, &st);
+		/* Reads back what could not be hashed on the fly, so before closing */
+		if (upload && checksum_final(&h.md, h.fd, &digests) != 0)
+			error("%s: incomplete checksum for \"%s\", "
+			    "notifying without one", __func__, h.name);
+		checksum_clean(&h.md);
+		if (fstat(h.fd, &st) == 0 && upload)
+			handle_drop_behind(&h, st.st_size);
 		ret = close(h.fd);
-		if (!ret                                      /* OK */
-		    && (h.flags & (O_CREAT|O_TRUNC|O_APPEND)) /* Create or Truncate or Append: (re)upload */
-		    && !(h.flags & O_RDONLY)                  /* not Read-Only */
-		    )
-		  {
-		    unsigned char digest[MQ_CHECKSUM_SIZE];
-		    checksum_final(&h.md, digest);
-		    mq_send_upload(pw->pw_name, h.name, digest, st.st_size, st.st_mtime);
-		  }
+		if (!ret && upload)                           /* OK */
+		    mq_send_upload(pw->pw_name, h.name, &digests, st.st_size, st.st_mtime);
 	        free(h.name);
                 handle_unused(handle);
 	} else if (handle_is_ok(handle, HANDLE_DIR)) {
@@ -477,6 +719,26 @@ handle_log_close(int handle, char *emsg)
 	}
 }
 
+/*
+ * Interrupted uploads: give back what was allocated past their end, and
+ * keep their checksum state, for when they resume
+ */
+static void
+handle_save_checksums(void)
+{
+	struct stat st;
+	u_int i;
+
+	for (i = 0; i < num_handles; i++) {
+		if (handles[i].use != HANDLE_FILE ||
+		    (handles[i].flags & O_ACCMODE) == O_RDONLY)
+			continue;
+		if (fstat(handles[i].fd, &st) == 0)
+			handle_trim(&handles[i], &st);
+		checksum_save(&(handles[i].md), handles[i].fd);
+	}
+}
+
 static void
 handle_log_exit(void)
 {
@@ -581,6 +843,131 @@ send_data(u_int32_t id, const u_char *data, int dlen)
 	send_data_or_handle(SSH2_FXP_DATA, id, data, dlen);
 }
 
+#ifdef HAVE_SPLICE
+static void
+splice_start(int out)
+{
+	struct stat st;
+	int flags;
+
+	if (fstat(out, &st) == -1 || !S_ISFIFO(st.st_mode) ||
+	    (flags = fcntl(out, F_GETFL)) == -1 || (flags & O_NONBLOCK))
+		return;
+	if (pipe(splice_pipe) == -1) {
+		debug("%s: pipe: %s", __func__, strerror(errno));
+		splice_pipe[0] = splice_pipe[1] = -1;
+		return;
+	}
+#ifdef F_SETPIPE_SZ
+	/* Short reads otherwise, which the clients handle */
+	if (fcntl(splice_pipe[1], F_SETPIPE_SZ, max_read) == -1)
+		debug("%s: F_SETPIPE_SZ %u: %s", __func__, max_read,
+		    strerror(errno));
+#endif
+	splice_out = out;
+}
+
+static void
+splice_stop(void)
+{
+	close(splice_pipe[0]);
+	close(splice_pipe[1]);
+	splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+/*
+ * Splicing failed after 'n' bytes: sends them and the rest of the
+ * range, up to 'len', read from 'loff' on, in a single reply.
+ */
+static int
+send_data_unsplice(u_int32_t id, int fd, loff_t loff, size_t n,
+    u_int32_t len)
+{
+	ssize_t r;
+
+	if (read_buf == NULL)
+		read_buf = xmalloc(max_read);
+	if (atomicio(read, splice_pipe[0], read_buf, n) != n)
+		fatal("%s: read: %s", __func__, strerror(errno));
+	splice_stop();
+	while ((r = pread(fd, read_buf + n, len - n, loff)) == -1 &&
+	    errno == EINTR)
+		;
+	if (r > 0)
+		n += r;
+	send_data(id, read_buf, n);
+	return n;
+}
+#endif
+
+/*
+ * Replies to a read straight from the file, flushing the replies queued
+ * before it. Returns the bytes sent, 0 at EOF, -1 on error, or -2 when
+ * the file must be read instead.
+ */
+static int
+send_data_splice(u_int32_t id, int fd, u_int64_t off, u_int32_t len)
+{
+#ifdef HAVE_SPLICE
+	loff_t loff = off;
+	ssize_t n = 0, r;
+	size_t olen;
+	int rc;
+
+	if (splice_pipe[0] == -1 || len < SFTP_SPLICE_MIN)
+		return -2;
+	/* Splices stop at page cache boundaries: fill up the pipe */
+	while ((size_t)n < len) {
+		r = splice(fd, &loff, splice_pipe[1], NULL, len - n,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (r > 0)
+			n += r;
+		else if (r == 0 || (errno == EAGAIN && n > 0))
+			break;
+		else if (errno == EINVAL || errno == ENOSYS) {
+			/* e.g. a file system without splice support */
+			debug("%s: splice: %s, reading instead", __func__,
+			    strerror(errno));
+			if (n > 0)
+				return send_data_unsplice(id, fd, loff, n, len);
+			splice_stop();
+			return -2;
+		} else if (errno == EINTR)
+			continue;
+		else if (n > 0)
+			break; /* a short read, the error comes next time */
+		else
+			return -1;
+	}
+	if (n == 0)
+		return 0;
+
+	debug("request %u: sent data len %zd", id, n);
+	if ((rc = sshbuf_put_u32(oqueue, 1 + 4 + 4 + n)) != 0 ||
+	    (rc = sshbuf_put_u8(oqueue, SSH2_FXP_DATA)) != 0 ||
+	    (rc = sshbuf_put_u32(oqueue, id)) != 0 ||
+	    (rc = sshbuf_put_u32(oqueue, n)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(rc));
+	olen = sshbuf_len(oqueue);
+	if (atomicio(vwrite, splice_out, (u_char *)sshbuf_ptr(oqueue),
+	    olen) != olen)
+		fatal("%s: write: %s", __func__, strerror(errno));
+	sshbuf_reset(oqueue);
+	for (olen = 0; olen < (size_t)n; olen += r) {
+		r = splice(splice_pipe[0], NULL, splice_out, NULL, n - olen,
+		    SPLICE_F_MOVE);
+		if (r == -1 && errno == EINTR)
+			r = 0;
+		else if (r <= 0)
+			fatal("%s: splice: %s", __func__,
+			    r == 0 ? "EOF" : strerror(errno));
+	}
+	return n;
+#else
+	return -2;
+#endif
+}
+
 static void
 send_handle(u_int32_t id, int handle)
 {
@@ -692,6 +1079,11 @@ process_init(void)
 	    (r = sshbuf_put_cstring(msg, "1")) != 0 || /* version */
 	    /* fsync extension */
 	    (r = sshbuf_put_cstring(msg, "fsync@openssh.com")) != 0 ||
+	    (r = sshbuf_put_cstring(msg, "1")) != 0 || /* version */
+	    /* check-file extensions */
+	    (r = sshbuf_put_cstring(msg, "check-file-handle")) != 0 ||
+	    (r = sshbuf_put_cstring(msg, "1")) != 0 || /* version */
+	    (r = sshbuf_put_cstring(msg, "check-file-name")) != 0 ||
 	    (r = sshbuf_put_cstring(msg, "1")) != 0) /* version */
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	send_msg(msg);
@@ -723,7 +1115,15 @@ process_open(u_int32_t id)
 		verbose("Refusing open request in read-only mode");
 		status = SSH2_FX_PERMISSION_DENIED;
 	} else {
-		fd = open(name, flags, mode);
+		/*
+		 * Uploads are opened for reading too, for the checksum
+		 * to read back the data written out of order.
+		 */
+		fd = -1;
+		if ((flags & O_ACCMODE) == O_WRONLY)
+			fd = open(name, (flags & ~O_ACCMODE) | O_RDWR, mode);
+		if (fd < 0 && ((flags & O_ACCMODE) != O_WRONLY || errno == EACCES))
+			fd = open(name, flags, mode);
 		if (fd < 0) {
 			status = errno_to_portable(errno);
 		} else {
@@ -731,7 +1131,28 @@ process_open(u_int32_t id)
 			if (handle < 0) {
 				close(fd);
 			} else {
-			        checksum_init(&(handles[handle].md));
+#ifdef HAVE_POSIX_FADVISE
+				if ((flags & O_ACCMODE) == O_RDONLY)
+					posix_fadvise(fd, 0, 0,
+					    POSIX_FADV_SEQUENTIAL);
+#endif
+			        checksum_init(&(handles[handle].md), (mq_options)?mq_options->checksums:0);
+				/* Resuming an upload: start from the saved state */
+				if ((flags & O_ACCMODE) != O_RDONLY && !(flags & O_TRUNC))
+					checksum_restore(&(handles[handle].md), fd);
+				if ((flags & O_ACCMODE) != O_RDONLY &&
+				    !(flags & O_APPEND)) {
+					handles[handle].alloc_end = 0;
+					/*
+					 * The size announced by the client, at
+					 * most a step: the writes grow it later
+					 */
+					if ((a.flags & SSH2_FILEXFER_ATTR_SIZE) &&
+					    a.size > 0)
+						handle_preallocate(handle, 0,
+						    MINIMUM(a.size,
+						    SFTP_PREALLOC_MAX));
+				}
 				send_handle(id, handle);
 				status = SSH2_FX_OK;
 			}
@@ -760,7 +1181,6 @@ process_close(u_int32_t id)
 static void
 process_read(u_int32_t id)
 {
-	u_char buf[64*1024];
 	u_int32_t len;
 	int r, handle, fd, ret, status = SSH2_FX_FAILURE;
 	u_int64_t off;
@@ -772,74 +1192,496 @@ process_read(u_int32_t id)
 
 	debug("request %u: read \"%s\" (handle %d) off %llu len %d",
 	    id, handle_to_name(handle), handle, (unsigned long long)off, len);
-	if (len > sizeof buf) {
-		len = sizeof buf;
+	if (len > max_read) {
+		len = max_read;
 		debug2("read change len %d", len);
 	}
 	fd = handle_to_fd(handle);
 	if (fd >= 0) {
-		if (lseek(fd, off, SEEK_SET) < 0) {
-			error("process_read: seek failed");
+		handle_read_ahead(handle, off, len);
+		if ((ret = send_data_splice(id, fd, off, len)) == -2) {
+			if (read_buf == NULL)
+				read_buf = xmalloc(max_read);
+			if ((ret = pread(fd, read_buf, len, off)) > 0)
+				send_data(id, read_buf, ret);
+		}
+		if (ret < 0) {
 			status = errno_to_portable(errno);
+		} else if (ret == 0) {
+			status = SSH2_FX_EOF;
 		} else {
-			ret = read(fd, buf, len);
-			if (ret < 0) {
-				status = errno_to_portable(errno);
-			} else if (ret == 0) {
-				status = SSH2_FX_EOF;
-			} else {
-				send_data(id, buf, ret);
-				status = SSH2_FX_OK;
-				handle_update_read(handle, ret);
-			}
+			status = SSH2_FX_OK;
+			handle_update_read(handle, ret);
 		}
 	}
 	if (status != SSH2_FX_OK)
 		send_status(id, status);
 }
 
-static void
-process_write(u_int32_t id)
+/*
+ * Peeks at the next packet in iqueue: if it is a write to the same
+ * handle, at 'off', and it is all there, returns its id, data and
+ * total length.
+ */
+static int
+peek_next_write(const u_char *hstr, u_int64_t off, u_int32_t *idp,
+    const u_char **datap, size_t *lenp, size_t *plenp)
 {
+	const u_char *cp = sshbuf_ptr(iqueue);
+	size_t avail = sshbuf_len(iqueue);
+	u_int32_t msg_len, dlen;
+
+	/* len type id handle(4+4) off data(4+...) */
+	if (avail < 29)
+		return 0;
+	msg_len = get_u32(cp);
+	if (msg_len > SFTP_MAX_MSG_LENGTH || avail < 4 + (size_t)msg_len ||
+	    cp[4] != SSH2_FXP_WRITE ||
+	    get_u32(cp + 9) != sizeof(int32_t) ||
+	    memcmp(cp + 13, hstr, sizeof(int32_t)) != 0 ||
+	    get_u64(cp + 17) != off)
+		return 0;
+	dlen = get_u32(cp + 25);
+	if ((size_t)msg_len != 25 + (size_t)dlen)
+		return 0;
+	*idp = get_u32(cp + 5);
+	*datap = cp + 29;
+	*lenp = dlen;
+	*plenp = 4 + (size_t)msg_len;
+	return 1;
+}
+
+/*
+ * Asynchronous writes: a pipeline of two threads, one that writes the
+ * data, the next that hashes it, while the main loop keeps reading the
+ * next requests. Each write is answered when both are done with it.
+ * Any other request first waits for all the writes in flight, so that
+ * the handles only change in between.
+ */
+struct async_write {
+	int handle, fd, append, n, err;
 	u_int64_t off;
+	u_int32_t ids[SFTP_WRITE_COALESCE];
+	struct iovec iov[SFTP_WRITE_COALESCE];
+	struct sshbuf *pinned;		/* iqueue, kept for the data */
+	u_char *data;			/* or a copy of it */
 	size_t len;
-	int r, handle, fd, ret, status;
-	u_char *data;
+	ssize_t ret;
+};
+
+/*
+ * Lock-free ring between one producer and one consumer, in order.
+ * The lock is only taken by a consumer going to sleep on an empty
+ * ring, and by the producer waking it up.
+ */
+#define SFTP_ASYNC_RING		256	/* power of 2 */
+struct async_ring {
+	struct async_write *slots[SFTP_ASYNC_RING];
+	u_int head;			/* producer side */
+	u_int tail;			/* consumer side */
+	int sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+};
+#define ASYNC_RING_INITIALIZER \
+	{ { NULL }, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER }
+
+static void
+ring_push(struct async_ring *r, struct async_write *w)
+{
+	u_int head = r->head;
+
+	r->slots[head & (SFTP_ASYNC_RING - 1)] = w;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->wakeup);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+/* The next entry, or NULL if there is none and not 'wait' */
+static struct async_write *
+ring_pop(struct async_ring *r, int wait)
+{
+	struct async_write *w;
+	u_int tail = r->tail;
+
+	if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+		if (!wait)
+			return NULL;
+		pthread_mutex_lock(&r->lock);
+		__atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail)
+			pthread_cond_wait(&r->wakeup, &r->lock);
+		__atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&r->lock);
+	}
+	w = r->slots[tail & (SFTP_ASYNC_RING - 1)];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return w;
+}
+
+static pthread_t async_writer, async_hasher;
+/* main -> writer -> hasher -> main */
+static struct async_ring async_todo = ASYNC_RING_INITIALIZER;
+static struct async_ring async_written = ASYNC_RING_INITIALIZER;
+static struct async_ring async_done = ASYNC_RING_INITIALIZER;
+/* Readable when async_done gets filled */
+static int async_pipe[2] = { -1, -1 };
+/* Set by the hasher when it cannot wake the main thread up any more */
+static int async_failed;
+/* Main thread only */
+static int async_pinned;		/* iqueue is held by writes in flight */
+static u_int async_pending;
+static size_t async_bytes;
+
+static void *
+async_write_worker(void *arg)
+{
+	struct async_write *w;
+
+	for (;;) {
+		if ((w = ring_pop(&async_todo, 1)) == NULL) {
+			ring_push(&async_written, NULL);	/* stop */
+			return NULL;
+		}
+		if (w->append) {
+			w->ret = writev(w->fd, w->iov, w->n);
+			/* Appended: where it actually landed */
+			if (w->ret > 0)
+				w->off = lseek(w->fd, 0, SEEK_CUR) - w->ret;
+		} else
+			w->ret = pwritev(w->fd, w->iov, w->n, w->off);
+		w->err = errno;
+		handle_write_behind(w->handle, w->off, w->ret);
+		ring_push(&async_written, w);
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+static void *
+async_hash_worker(void *arg)
+{
+	struct async_write *w;
+	u_int64_t off;
+	size_t done, l;
+	int i;
+
+	for (;;) {
+		if ((w = ring_pop(&async_written, 1)) == NULL)
+			return NULL;		/* stop */
+		done = (w->ret > 0) ? (size_t)w->ret : 0;
+		for (off = w->off, i = 0; i < w->n; i++) {
+			l = MINIMUM(w->iov[i].iov_len, done);
+			handle_update_checksum(w->handle, off,
+			    w->iov[i].iov_base, l);
+			off += l;
+			done -= l;
+		}
+		ring_push(&async_done, w);
+		if (write(async_pipe[1], "", 1) == -1 && errno != EAGAIN &&
+		    !__atomic_load_n(&async_failed, __ATOMIC_RELAXED)) {
+			error("%s: write to wake-up pipe: %s", __func__,
+			    strerror(errno));
+			__atomic_store_n(&async_failed, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+static void
+async_start(void)
+{
+	sigset_t all, old;
+	int r;
+
+	if (pipe(async_pipe) == -1)
+		fatal("%s: pipe: %s", __func__, strerror(errno));
+	if (set_nonblock(async_pipe[0]) == -1 ||
+	    set_nonblock(async_pipe[1]) == -1)
+		fatal("%s: set_nonblock failed", __func__);
+	fcntl(async_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(async_pipe[1], F_SETFD, FD_CLOEXEC);
+	/* The signals stay with the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if ((r = pthread_create(&async_writer, NULL,
+	    async_write_worker, NULL)) != 0 ||
+	    (r = pthread_create(&async_hasher, NULL,
+	    async_hash_worker, NULL)) != 0)
+		fatal("%s: pthread_create: %s", __func__, strerror(r));
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	debug("%s: asynchronous writes enabled", __func__);
+}
+
+/* In-process, at the end of the session: the threads are idle */
+static void
+async_stop(void)
+{
+	if (async_pipe[0] == -1)
+		return;
+	ring_push(&async_todo, NULL);
+	pthread_join(async_writer, NULL);
+	pthread_join(async_hasher, NULL);
+	close(async_pipe[0]);
+	close(async_pipe[1]);
+	async_pipe[0] = async_pipe[1] = -1;
+	async_failed = 0;
+}
+
+/* Forked from a process running the threads: they are not there */
+static void
+async_forget(void)
+{
+	struct async_ring *rings[] = { &async_todo, &async_written, &async_done };
+	u_int i;
+
+	if (async_pipe[0] == -1)
+		return;
+	for (i = 0; i < sizeof(rings) / sizeof(*rings); i++) {
+		rings[i]->head = rings[i]->tail = 0;
+		rings[i]->sleeping = 0;
+		pthread_mutex_init(&rings[i]->lock, NULL);
+		pthread_cond_init(&rings[i]->wakeup, NULL);
+	}
+	close(async_pipe[0]);
+	close(async_pipe[1]);
+	async_pipe[0] = async_pipe[1] = -1;
+	async_pending = 0;
+	async_bytes = 0;
+	async_failed = 0;
+	async_pinned = 0;
+}
+
+static void
+async_submit(int handle, int fd, u_int64_t off, const struct iovec *iov,
+    const u_int32_t *ids, int n)
+{
+	struct async_write *w;
+	int i;
+
+	/* Backpressure: stop reading requests until some memory is back */
+	while (async_bytes >= SFTP_ASYNC_MAX_BYTES ||
+	    async_pending >= SFTP_ASYNC_RING)
+		async_collect(1);
+
+	w = xcalloc(1, sizeof(*w));
+	for (i = 0; i < n; i++) {
+		w->ids[i] = ids[i];
+		w->iov[i] = iov[i];
+		w->len += iov[i].iov_len;
+	}
+	if (!inproc) {
+		/*
+		 * The data stays where it was read: iqueue is kept alive
+		 * until the reply, and the main loop reads into a new one.
+		 */
+		if ((w->pinned = sshbuf_fromb(iqueue)) == NULL)
+			fatal("%s: sshbuf_fromb failed", __func__);
+		async_pinned = 1;
+	} else {
+		/* The channel's buffer, which the channel goes on filling */
+		w->data = xmalloc(w->len + 1);
+		for (w->len = 0, i = 0; i < n; i++) {
+			memcpy(w->data + w->len, iov[i].iov_base,
+			    iov[i].iov_len);
+			w->iov[i].iov_base = w->data + w->len;
+			w->len += iov[i].iov_len;
+		}
+	}
+	w->handle = handle;
+	w->fd = fd;
+	w->append = (handle_to_flags(handle) & O_APPEND) != 0;
+	w->n = n;
+	w->off = off;
+	async_pending++;
+	async_bytes += w->len;
+
+	ring_push(&async_todo, w);
+}
+
+static void
+async_reply(struct async_write *w)
+{
+	size_t done, l;
+	int i, status = SSH2_FX_FAILURE;
+
+	if (__atomic_load_n(&async_failed, __ATOMIC_SEQ_CST)) {
+		/* Like an I/O error: the replies may have been held back */
+		w->ret = -1;
+		w->err = EIO;
+	}
+	if (w->ret < 0) {
+		error("process_write: write failed");
+		status = errno_to_portable(w->err);
+	} else
+		handle_update_write(w->handle, w->ret);
+	done = (w->ret > 0) ? (size_t)w->ret : 0;
+	for (i = 0; i < w->n; i++) {
+		if (w->ret >= 0) {
+			l = MINIMUM(w->iov[i].iov_len, done);
+			done -= l;
+			if (l == w->iov[i].iov_len)
+				status = SSH2_FX_OK;
+			else {
+				debug2("nothing at all written");
+				status = SSH2_FX_FAILURE;
+			}
+		}
+		send_status(w->ids[i], status);
+	}
+	async_pending--;
+	async_bytes -= w->len;
+	sshbuf_free(w->pinned);
+	free(w->data);
+	free(w);
+}
+
+/* Answers the completed writes. If 'wait', waits for at least one. */
+static void
+async_collect(int wait)
+{
+	struct async_write *w;
+	char buf[64];
+
+	while (read(async_pipe[0], buf, sizeof(buf)) > 0)
+		;
+	/* No more wake-ups: the writes in flight all fail */
+	if (__atomic_load_n(&async_failed, __ATOMIC_SEQ_CST))
+		wait = async_pending;
+	while (wait-- > 0 && async_pending > 0)
+		async_reply(ring_pop(&async_done, 1));
+	while ((w = ring_pop(&async_done, 0)) != NULL)
+		async_reply(w);
+}
+
+/* Barrier: all the writes in flight are done, and answered */
+static void
+async_wait(void)
+{
+	while (async_pending > 0)
+		async_collect(1);
+}
 
+/* Leaves iqueue to the writes in flight, with a copy of what is unread */
+static void
+async_unpin(void)
+{
+	struct sshbuf *b;
+	int r;
+
+	if (!async_pinned)
+		return;
+	async_pinned = 0;
+	if ((b = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_putb(b, iqueue)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(iqueue);
+	iqueue = b;
+}
+
+static void
+process_write(u_int32_t id)
+{
+	struct iovec iov[SFTP_WRITE_COALESCE];
+	u_int32_t ids[SFTP_WRITE_COALESCE];
+	int status[SFTP_WRITE_COALESCE];
+	u_char hstr[sizeof(int32_t)];
+	u_int64_t off, next;
+	size_t len, plen, done, w;
+	int i, n = 1, r, handle, fd;
+	ssize_t ret;
+	const u_char *data;
+
+	/* The data is written straight from iqueue, without a copy */
 	if ((r = get_handle(iqueue, &handle)) != 0 ||
 	    (r = sshbuf_get_u64(iqueue, &off)) != 0 ||
-	    (r = sshbuf_get_string(iqueue, &data, &len)) != 0)
+	    (r = sshbuf_get_string_direct(iqueue, &data, &len)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
 	debug("request %u: write \"%s\" (handle %d) off %llu len %zu",
 	    id, handle_to_name(handle), handle, (unsigned long long)off, len);
 	fd = handle_to_fd(handle);
+	ids[0] = id;
+	iov[0].iov_base = (void *)data;
+	iov[0].iov_len = len;
+
+	/* Take along the next writes, if they follow this one */
+	if (fd >= 0 && sshbuf_len(iqueue) == iqueue_rest) {
+		put_u32(hstr, handle);
+		next = off + len;
+		while (n < SFTP_WRITE_COALESCE &&
+		    peek_next_write(hstr, next, &ids[n], &data, &len, &plen)) {
+			debug("request %u: write \"%s\" (handle %d) off %llu "
+			    "len %zu (coalesced)", ids[n], handle_to_name(handle),
+			    handle, (unsigned long long)next, len);
+			iov[n].iov_base = (void *)data;
+			iov[n].iov_len = len;
+			if ((r = sshbuf_consume(iqueue, plen)) != 0)
+				fatal("%s: buffer error: %s",
+				    __func__, ssh_err(r));
+			iqueue_extra += plen;
+			iqueue_rest -= plen;
+			next += len;
+			n++;
+		}
+	}
 
-	if (fd < 0)
-		status = SSH2_FX_FAILURE;
-	else {
-		if (!(handle_to_flags(handle) & O_APPEND) &&
-				lseek(fd, off, SEEK_SET) < 0) {
-			status = errno_to_portable(errno);
-			error("process_write: seek failed");
-		} else {
+	if (fd >= 0) {
+		for (next = off, i = 0; i < n; i++)
+			next += iov[i].iov_len;
+		handle_preallocate(handle, off, next);
+	}
+
+	if (fd >= 0 && async_io) {
+		if (!__atomic_load_n(&async_failed, __ATOMIC_SEQ_CST)) {
+			async_submit(handle, fd, off, iov, ids, n);
+			return;
+		}
+		fd = -1;	/* the pipeline failed, and so does the write */
+	}
+
+	if (fd < 0) {
+		for (i = 0; i < n; i++)
+			status[i] = SSH2_FX_FAILURE;
+	} else {
 /* XXX ATOMICIO ? */
-			ret = write(fd, data, len);
-			if (ret < 0) {
-				error("process_write: write failed");
-				status = errno_to_portable(errno);
-			} else if ((size_t)ret == len) {
-				status = SSH2_FX_OK;
-				handle_update_write(handle, ret);
-				handle_update_checksum(handle, data, ret);
-			} else {
-				debug2("nothing at all written");
-				status = SSH2_FX_FAILURE;
+		if (handle_to_flags(handle) & O_APPEND)
+			ret = writev(fd, iov, n);
+		else
+			ret = pwritev(fd, iov, n, off);
+		if (ret < 0) {
+			error("process_write: write failed");
+			r = errno_to_portable(errno);
+			for (i = 0; i < n; i++)
+				status[i] = r;
+		} else {
+			handle_update_write(handle, ret);
+			/* Appended: where it actually landed */
+			if (handle_to_flags(handle) & O_APPEND)
+				off = lseek(fd, 0, SEEK_CUR) - ret;
+			handle_write_behind(handle, off, ret);
+			for (done = ret, i = 0; i < n; i++) {
+				w = MINIMUM(iov[i].iov_len, done);
+				handle_update_checksum(handle, off,
+				    iov[i].iov_base, w);
+				off += w;
+				done -= w;
+				if (w == iov[i].iov_len)
+					status[i] = SSH2_FX_OK;
+				else {
+					debug2("nothing at all written");
+					status[i] = SSH2_FX_FAILURE;
+				}
 			}
 		}
 	}
-	send_status(id, status);
-	free(data);
+	for (i = 0; i < n; i++)
+		send_status(ids[i], status[i]);
 }
 
 static void
@@ -989,6 +1831,8 @@ process_fsetstat(u_int32_t id)
 			r = ftruncate(fd, a.size);
 			if (r == -1)
 				status = errno_to_portable(errno);
+			else
+				handle_truncate_checksum(handle, a.size);
 		}
 		if (a.flags & SSH2_FILEXFER_ATTR_PERMISSIONS) {
 			logit("set \"%s\" mode %04o", name, a.perm);
@@ -1401,6 +2245,106 @@ process_extended_fsync(u_int32_t id)
 	send_status(id, status);
 }
 
+/*
+ * check-file-handle and check-file-name (draft-ietf-secsh-filexfer):
+ * the digest of a whole file, in the first of the client's algorithms
+ * we have. An uploaded file is not read again: its digests are those
+ * of the state saved at the end of the upload.
+ */
+static void
+process_check_file(u_int32_t id, int fd, const char *name)
+{
+	struct sshbuf *msg;
+	checksum_digests_t digests;
+	struct stat st;
+	const u_char *digest = NULL;
+	char *algs, *cp, *alg = NULL;
+	u_int64_t off, len;
+	u_int32_t bsize;
+	size_t dlen;
+	int r, type = 0, types, status = SSH2_FX_OK;
+
+	if ((r = sshbuf_get_cstring(iqueue, &algs, NULL)) != 0 ||
+	    (r = sshbuf_get_u64(iqueue, &off)) != 0 ||
+	    (r = sshbuf_get_u64(iqueue, &len)) != 0 ||
+	    (r = sshbuf_get_u32(iqueue, &bsize)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	debug3("request %u: check-file \"%s\" %s off %llu len %llu "
+	    "block %u", id, name, algs, (unsigned long long)off,
+	    (unsigned long long)len, bsize);
+	verbose("check-file \"%s\"", name);
+	for (cp = algs; type == 0 && (alg = strsep(&cp, ",")) != NULL; )
+		type = checksum_types(alg);
+
+	if (type == 0)
+		status = SSH2_FX_OP_UNSUPPORTED;
+	else if (fstat(fd, &st) == -1)
+		status = errno_to_portable(errno);
+	else if (off != 0 || (len != 0 && len < (u_int64_t)st.st_size) ||
+	    (bsize != 0 && bsize < (u_int64_t)st.st_size)) {
+		/* Only whole files */
+		status = SSH2_FX_OP_UNSUPPORTED;
+	} else {
+		/* The digests of the upload, for its saved state to do */
+		types = (mq_options != NULL && mq_options->checksums != 0) ?
+		    mq_options->checksums : MQ_CHECKSUM_SHA256;
+		if ((types & type) == 0)
+			types = type;
+		if (checksum_file(fd, types, &digests) != 0 ||
+		    (digest = checksum_digest(&digests, type, &dlen)) == NULL)
+			status = SSH2_FX_FAILURE;
+	}
+
+	if (status != SSH2_FX_OK) {
+		send_status(id, status);
+		free(algs);
+		return;
+	}
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u8(msg, SSH2_FXP_EXTENDED_REPLY)) != 0 ||
+	    (r = sshbuf_put_u32(msg, id)) != 0 ||
+	    (r = sshbuf_put_cstring(msg, "check-file")) != 0 ||
+	    (r = sshbuf_put_cstring(msg, checksum_type_name(type))) != 0 ||
+	    (r = sshbuf_put(msg, digest, dlen)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	send_msg(msg);
+	sshbuf_free(msg);
+	free(algs);
+}
+
+static void
+process_extended_check_file_handle(u_int32_t id)
+{
+	int handle, fd, r;
+
+	if ((r = get_handle(iqueue, &handle)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	/* process() skips the rest of the request */
+	if ((fd = handle_to_fd(handle)) < 0)
+		send_status(id, SSH2_FX_FAILURE);
+	else
+		process_check_file(id, fd, handle_to_name(handle));
+}
+
+static void
+process_extended_check_file_name(u_int32_t id)
+{
+	char *name;
+	int fd, r;
+
+	if ((r = sshbuf_get_cstring(iqueue, &name, NULL)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if ((fd = open(name, O_RDONLY)) < 0)
+		send_status(id, errno_to_portable(errno));
+	else {
+		process_check_file(id, fd, name);
+		close(fd);
+	}
+	free(name);
+}
+
 static void
 process_extended(u_int32_t id)
 {
@@ -1450,12 +2394,18 @@ process(void)
 	}
 	if (buf_len < msg_len + 4)
 		return;
+	iqueue_rest = buf_len - msg_len - 4;
+	iqueue_extra = 0;
 	if ((r = sshbuf_consume(iqueue, 4)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	buf_len -= 4;
 	if ((r = sshbuf_get_u8(iqueue, &type)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
+	/* Only the writes can overtake the writes in flight */
+	if (type != SSH2_FXP_WRITE)
+		async_wait();
+
 	switch (type) {
 	case SSH2_FXP_INIT:
 		process_init();
@@ -1492,7 +2442,7 @@ process(void)
 		error("iqueue grew unexpectedly");
 		sftp_server_cleanup_exit(255);
 	}
-	consumed = buf_len - sshbuf_len(iqueue);
+	consumed = buf_len - sshbuf_len(iqueue) - iqueue_extra;
 	if (msg_len < consumed) {
 		error("msg_len %u < consumed %u", msg_len, consumed);
 		sftp_server_cleanup_exit(255);
@@ -1502,11 +2452,158 @@ process(void)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 }
 
+/* What the main loop can do, after sftp_wait() */
+#define SFTP_CAN_READ		0x01
+#define SFTP_CAN_WRITE		0x02
+#define SFTP_CAN_COLLECT	0x04
+
+static int sftp_in = -1, sftp_out = -1;
+static fd_set *sftp_rset, *sftp_wset;
+static int sftp_maxfd;
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * The descriptors never change, so they stay registered with epoll:
+ * stdin is only removed while reads are held back, and stdout is
+ * edge-triggered and only waited for after a write fell short.
+ * Reads from stdin are bounded, so it stays level-triggered.
+ */
+static int sftp_epfd = -1;
+static int sftp_epoll_in;	/* stdin registered */
+static int sftp_out_ready = 1;	/* stdout did not fill up */
+
+static int
+sftp_epoll_ctl(int op, int fd, u_int32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(sftp_epfd, op, fd, &ev);
+}
+#endif
+
+static void
+sftp_wait_init(int in, int out)
+{
+	sftp_in = in;
+	sftp_out = out;
+	sftp_maxfd = MAXIMUM(in, out);
+	if (async_io)
+		sftp_maxfd = MAXIMUM(sftp_maxfd, async_pipe[0]);
+
+#ifdef HAVE_SYS_EPOLL_H
+	if ((sftp_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		error("%s: epoll_create1: %s", __func__, strerror(errno));
+	else if (sftp_epoll_ctl(EPOLL_CTL_ADD, in, EPOLLIN) == -1 ||
+	    sftp_epoll_ctl(EPOLL_CTL_ADD, out, EPOLLOUT|EPOLLET) == -1 ||
+	    (async_io &&
+	    sftp_epoll_ctl(EPOLL_CTL_ADD, async_pipe[0], EPOLLIN) == -1)) {
+		/* e.g. regular files, that epoll does not support */
+		debug("%s: epoll_ctl: %s, using select", __func__,
+		    strerror(errno));
+		close(sftp_epfd);
+		sftp_epfd = -1;
+	} else {
+		sftp_epoll_in = 1;
+		return;
+	}
+#endif
+	sftp_rset = xcalloc(howmany(sftp_maxfd + 1, NFDBITS),
+	    sizeof(fd_mask));
+	sftp_wset = xcalloc(howmany(sftp_maxfd + 1, NFDBITS),
+	    sizeof(fd_mask));
+}
+
+/* Returns what can be done (SFTP_CAN_*), or -1 on error */
+static int
+sftp_wait(int want_read, int want_write)
+{
+	struct timeval tv, *tvp = NULL;
+	size_t set_size;
+	int can = 0, timeout = -1;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev[3];
+	int i, n;
+#endif
+
+	if (async_pending > 0) {
+		timeout = SFTP_ASYNC_POLL_MS;
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		tvp = &tv;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+
+	if (sftp_epfd != -1) {
+		/* Hangups are always reported: remove stdin altogether */
+		if (want_read != sftp_epoll_in) {
+			if (sftp_epoll_ctl(want_read ? EPOLL_CTL_ADD :
+			    EPOLL_CTL_DEL, sftp_in, EPOLLIN) == -1)
+				fatal("%s: epoll_ctl: %s", __func__,
+				    strerror(errno));
+			sftp_epoll_in = want_read;
+		}
+		if (want_write && sftp_out_ready)
+			can |= SFTP_CAN_WRITE;
+		if ((n = epoll_wait(sftp_epfd, ev, 3, can ? 0 : timeout)) == -1)
+			return -1;
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.fd == sftp_in)
+				can |= SFTP_CAN_READ;
+			else if (ev[i].data.fd == sftp_out) {
+				sftp_out_ready = 1;
+				if (want_write)
+					can |= SFTP_CAN_WRITE;
+			} else
+				can |= SFTP_CAN_COLLECT;
+		}
+		return can;
+	}
+#endif
+
+	set_size = howmany(sftp_maxfd + 1, NFDBITS) * sizeof(fd_mask);
+	memset(sftp_rset, 0, set_size);
+	memset(sftp_wset, 0, set_size);
+	if (want_read)
+		FD_SET(sftp_in, sftp_rset);
+	if (want_write)
+		FD_SET(sftp_out, sftp_wset);
+	if (async_io)
+		FD_SET(async_pipe[0], sftp_rset);
+
+	if (select(sftp_maxfd + 1, sftp_rset, sftp_wset, NULL, tvp) < 0)
+		return -1;
+
+	if (FD_ISSET(sftp_in, sftp_rset))
+		can |= SFTP_CAN_READ;
+	if (FD_ISSET(sftp_out, sftp_wset))
+		can |= SFTP_CAN_WRITE;
+	if (async_io && FD_ISSET(async_pipe[0], sftp_rset))
+		can |= SFTP_CAN_COLLECT;
+	return can;
+}
+
+/* stdout is full: wait until it can take more */
+static void
+sftp_wait_blocked(void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	sftp_out_ready = 0;
+#endif
+}
+
 /* Cleanup handler that logs active handles upon normal exit */
 void
 sftp_server_cleanup_exit(int i)
 {
+	/* sshd cleans up, sftp_server_stop() included */
+	if (inproc)
+		cleanup_exit(i);
 
+	async_wait();
+        handle_save_checksums();
         clean_mq_config(); /* That will call mq_clean(); */
 
 	if (pw != NULL && client_addr != NULL) {
@@ -1523,36 +2620,97 @@ sftp_server_usage(void)
 	extern char *__progname;
 
 	fprintf(stderr,
-	    "usage: %s [-ehR] [-d start_directory] [-f log_facility] "
-	    "[-l log_level]\n\t[-P blacklisted_requests] "
-	    "[-p whitelisted_requests] [-u umask]\n"
+	    "usage: %s [-AehR] [-b max_input_size] [-d start_directory]\n\t"
+	    "[-f log_facility] [-l log_level] [-m max_read_size]\n\t"
+	    "[-P blacklisted_requests] "
+	    "[-p whitelisted_requests] [-u umask]\n\t"
+	    "[-W drop_behind_size]\n"
 	    "       %s -Q protocol_feature\n",
 	    __progname, __progname);
 	exit(1);
 }
 
-int
-sftp_server_main(int argc, char **argv, struct passwd *user_pw)
+/* Options and session setup, for both modes. 'remote' is set in-process */
+/* Back to the defaults, for the next session served in-process */
+static void
+sftp_server_reset(void)
+{
+	free(handles);
+	handles = NULL;
+	num_handles = 0;
+	first_unused_handle = -1;
+	free(request_whitelist);
+	free(request_blacklist);
+	request_whitelist = request_blacklist = NULL;
+	free(read_buf);
+	read_buf = NULL;
+	free(client_addr);
+	client_addr = NULL;
+	pw = NULL;
+	log_level = SYSLOG_LEVEL_ERROR;
+	input_chunk = max_input = SFTP_INPUT_CHUNK;
+	iqueue_extra = iqueue_rest = 0;
+	max_read = SFTP_DEFAULT_READ;
+	drop_behind = 0;
+	async_io = 0;
+	readonly = 0;
+	version = 0;
+	init_done = 0;
+	inproc = 0;
+}
+
+/*
+ * In a child forked while the session process served sftp in-process:
+ * the handles are the parent's, and the threads were left behind.
+ */
+static void
+sftp_server_forget(void)
+{
+	u_int i;
+
+	for (i = 0; i < num_handles; i++) {
+		if (handles[i].use == HANDLE_FILE) {
+			checksum_clean(&handles[i].md);
+			close(handles[i].fd);
+		} else if (handles[i].use == HANDLE_DIR)
+			closedir(handles[i].dirp);
+		else
+			continue;
+		free(handles[i].name);
+	}
+	async_forget();
+	sftp_server_reset();
+}
+
+static void
+sftp_server_init(int argc, char **argv, struct passwd *user_pw,
+    const char *remote)
 {
-	fd_set *rset, *wset;
-	int i, r, in, out, max, ch, skipargs = 0, log_stderr = 0;
-	ssize_t len, olen, set_size;
+	int i, ch, skipargs = 0, log_stderr = 0;
 	SyslogFacility log_facility = SYSLOG_FACILITY_AUTH;
-	char *cp, *homedir = NULL, uidstr[32], buf[4*4096];
+	char *cp, *homedir = NULL, uidstr[32];
+	const char *errstr;
 	long mask;
+	long long ll;
 
 	extern char *optarg;
 	extern char *__progname;
 
-	ssh_malloc_init();	/* must be called before any mallocs */
-	__progname = ssh_get_progname(argv[0]);
-	log_init(__progname, log_level, log_facility, log_stderr);
+	/* In-process, the logs and the process stay sshd's */
+	if (!inproc) {
+		ssh_malloc_init();	/* must be called before any mallocs */
+		__progname = ssh_get_progname(argv[0]);
+		log_init(__progname, log_level, log_facility, log_stderr);
+	}
 
 	pw = pwcopy(user_pw);
 
 	while (!skipargs && (ch = getopt(argc, argv,
-	    "d:f:l:P:p:Q:u:z:cehR")) != -1) {
+	    "b:d:f:l:m:P:p:Q:u:W:z:AcehR")) != -1) {
 		switch (ch) {
+		case 'A':
+			async_io = 1;
+			break;
 		case 'Q':
 			if (strcasecmp(optarg, "requests") != 0) {
 				fprintf(stderr, "Invalid query type\n");
@@ -1605,6 +2763,26 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 				fatal("Refused requests already set");
 			request_blacklist = xstrdup(optarg);
 			break;
+		case 'b':
+			max_input = (u_int)strtonum(optarg, SFTP_INPUT_CHUNK,
+			    SFTP_MAX_INPUT, &errstr);
+			if (errstr != NULL)
+				fatal("Invalid maximum input size \"%s\": %s",
+				    optarg, errstr);
+			break;
+		case 'm':
+			max_read = (u_int)strtonum(optarg, 1024,
+			    SFTP_MAX_READ, &errstr);
+			if (errstr != NULL)
+				fatal("Invalid maximum read size \"%s\": %s",
+				    optarg, errstr);
+			break;
+		case 'W':
+			if (scan_scaled(optarg, &ll) == -1 || ll < 0)
+				fatal("Invalid drop-behind size \"%s\"",
+				    optarg);
+			drop_behind = ll;
+			break;
 		case 'u':
 			errno = 0;
 			mask = strtol(optarg, &cp, 8);
@@ -1619,20 +2797,24 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 		}
 	}
 
-	log_init(__progname, log_level, log_facility, log_stderr);
+	if (!inproc) {
+		log_init(__progname, log_level, log_facility, log_stderr);
 
-	/*
-	 * On platforms where we can, avoid making /proc/self/{mem,maps}
-	 * available to the user so that sftp access doesn't automatically
-	 * imply arbitrary code execution access that will break
-	 * restricted configurations.
-	 */
-	platform_disable_tracing(1);	/* strict */
+		/*
+		 * On platforms where we can, avoid making /proc/self/{mem,maps}
+		 * available to the user so that sftp access doesn't
+		 * automatically imply arbitrary code execution access that
+		 * will break restricted configurations.
+		 */
+		platform_disable_tracing(1);	/* strict */
 
-	/* Drop any fine-grained privileges we don't need */
-	platform_pledge_sftp_server();
+		/* Drop any fine-grained privileges we don't need */
+		platform_pledge_sftp_server();
+	}
 
-	if ((cp = getenv("SSH_CONNECTION")) != NULL) {
+	if (remote != NULL)
+		client_addr = xstrdup(remote);
+	else if ((cp = getenv("SSH_CONNECTION")) != NULL) {
 		client_addr = xstrdup(cp);
 		if ((cp = strchr(client_addr, ' ')) == NULL) {
 			error("Malformed SSH_CONNECTION variable: \"%s\"",
@@ -1646,82 +2828,125 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 	logit("session opened for local user %s from [%s]",
 	    pw->pw_name, client_addr);
 
+	if (homedir != NULL) {
+		if (chdir(homedir) != 0) {
+			error("chdir to \"%s\" failed: %s", homedir,
+			    strerror(errno));
+		}
+	}
+}
+
+/* Terminated: the uploads are left as on a disconnection */
+static volatile sig_atomic_t received_sigterm = 0;
+
+static void
+sigterm_handler(int sig)
+{
+	received_sigterm = sig;
+}
+
+int
+sftp_server_main(int argc, char **argv, struct passwd *user_pw)
+{
+	int r, in, out, can, want_read;
+	ssize_t len, olen;
+	u_char *ibuf;
+
+	/* Forked from a session process serving sftp in-process */
+	if (inproc)
+		sftp_server_forget();
+	sftp_server_init(argc, argv, user_pw, NULL);
+
 	in = STDIN_FILENO;
 	out = STDOUT_FILENO;
+	signal(SIGTERM, sigterm_handler);
 
 #ifdef HAVE_CYGWIN
 	setmode(in, O_BINARY);
 	setmode(out, O_BINARY);
 #endif
 
-	max = 0;
-	if (in > max)
-		max = in;
-	if (out > max)
-		max = out;
+	if (async_io)
+		async_start();
+	sftp_wait_init(in, out);
+#ifdef HAVE_SPLICE
+	splice_start(out);
+#endif
 
 	if ((iqueue = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
 	if ((oqueue = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
 
-	rset = xcalloc(howmany(max + 1, NFDBITS), sizeof(fd_mask));
-	wset = xcalloc(howmany(max + 1, NFDBITS), sizeof(fd_mask));
-
-	if (homedir != NULL) {
-		if (chdir(homedir) != 0) {
-			error("chdir to \"%s\" failed: %s", homedir,
-			    strerror(errno));
-		}
-	}
-
-	set_size = howmany(max + 1, NFDBITS) * sizeof(fd_mask);
 	for (;;) {
-		memset(rset, 0, set_size);
-		memset(wset, 0, set_size);
+		if (received_sigterm) {
+			logit("Exiting on signal %d", (int)received_sigterm);
+			sftp_server_cleanup_exit(1);
+		}
 
 		/*
 		 * Ensure that we can read a full buffer and handle
 		 * the worst-case length packet it can generate,
 		 * otherwise apply backpressure by stopping reads.
 		 */
-		if ((r = sshbuf_check_reserve(iqueue, sizeof(buf))) == 0 &&
+		want_read = 0;
+		if (async_io)
+			async_unpin();
+		if ((r = sshbuf_check_reserve(iqueue, input_chunk)) == 0 &&
 		    (r = sshbuf_check_reserve(oqueue,
 		    SFTP_MAX_MSG_LENGTH)) == 0)
-			FD_SET(in, rset);
+			want_read = 1;
 		else if (r != SSH_ERR_NO_BUFFER_SPACE)
 			fatal("%s: sshbuf_check_reserve failed: %s",
 			    __func__, ssh_err(r));
 
 		olen = sshbuf_len(oqueue);
-		if (olen > 0)
-			FD_SET(out, wset);
 
-		if (select(max+1, rset, wset, NULL, NULL) < 0) {
+		if ((can = sftp_wait(want_read, olen > 0)) < 0) {
 			if (errno == EINTR)
 				continue;
 			error("select: %s", strerror(errno));
 			sftp_server_cleanup_exit(2);
 		}
 
-		/* copy stdin to iqueue */
-		if (FD_ISSET(in, rset)) {
-			len = read(in, buf, sizeof buf);
+		/* read stdin straight into iqueue */
+		if (can & SFTP_CAN_READ) {
+			if ((r = sshbuf_reserve(iqueue, input_chunk,
+			    &ibuf)) != 0)
+				fatal("%s: buffer error: %s",
+				    __func__, ssh_err(r));
+			len = read(in, ibuf, input_chunk);
+			/* give back the unused part of the reservation */
+			if ((r = sshbuf_consume_end(iqueue,
+			    input_chunk - (len > 0 ? len : 0))) != 0)
+				fatal("%s: buffer error: %s",
+				    __func__, ssh_err(r));
+			if (len == input_chunk && input_chunk < max_input)
+				input_chunk = MINIMUM(input_chunk * 2,
+				    max_input);
+			else if (len > 0 && len < input_chunk / 8 &&
+			    input_chunk > SFTP_INPUT_CHUNK)
+				input_chunk /= 2;
 			if (len == 0) {
 				debug("read eof");
 				sftp_server_cleanup_exit(0);
 			} else if (len < 0) {
 				error("read: %s", strerror(errno));
 				sftp_server_cleanup_exit(1);
-			} else if ((r = sshbuf_put(iqueue, buf, len)) != 0) {
-				fatal("%s: buffer error: %s",
-				    __func__, ssh_err(r));
 			}
 		}
+		/* answer the completed writes, or the failed ones */
+		if (can & SFTP_CAN_COLLECT || (can == 0 && async_pending > 0))
+			async_collect(0);
 		/* send oqueue to stdout */
-		if (FD_ISSET(out, wset)) {
+		if (can & SFTP_CAN_WRITE) {
 			len = write(out, sshbuf_ptr(oqueue), olen);
-			if (len < 0) {
+			if (len < 0 && (errno == EAGAIN ||
+			    errno == EWOULDBLOCK)) {
+				sftp_wait_blocked();
+			} else if (len < 0 && errno == EINTR) {
+				/* try again */
+			} else if (len < 0) {
 				error("write: %s", strerror(errno));
 				sftp_server_cleanup_exit(1);
 			} else if ((r = sshbuf_consume(oqueue, len)) != 0) {
@@ -1736,10 +2961,122 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 		 * and let the output queue drain.
 		 */
 		r = sshbuf_check_reserve(oqueue, SFTP_MAX_MSG_LENGTH);
-		if (r == 0)
-			process();
-		else if (r != SSH_ERR_NO_BUFFER_SPACE)
+		if (r == 0) {
+			/*
+			 * Nothing to wait for when the reply is not queued
+			 * (spliced, or written asynchronously): go on.
+			 */
+			do {
+				len = sshbuf_len(iqueue);
+				process();
+			} while (sshbuf_len(oqueue) == 0 &&
+			    sshbuf_len(iqueue) > 0 &&
+			    sshbuf_len(iqueue) != (size_t)len);
+		} else if (r != SSH_ERR_NO_BUFFER_SPACE)
 			fatal("%s: sshbuf_check_reserve: %s",
 			    __func__, ssh_err(r));
 	}
 }
+
+/*
+ * In-process mode: the session process, already running as the user
+ * in its chroot, hands the channel buffers over, with no pipe and no
+ * child in between.
+ */
+void
+sftp_server_start(int argc, char **argv, struct passwd *user_pw,
+    const char *remote)
+{
+	inproc = inproc_used = 1;
+	sftp_server_init(argc, argv, user_pw, remote);
+	if (async_io)
+		async_start();
+}
+
+/* Readable when asynchronous writes wait for their replies, or -1 */
+int
+sftp_server_wakeup_fd(void)
+{
+	return async_io ? async_pipe[0] : -1;
+}
+
+/*
+ * Serves the requests of 'in', and appends the replies to 'out'.
+ * Returns 1 when it waits for more requests, 0 when the replies must
+ * be sent first. The bytes taken from 'in' are added to '*consumed'.
+ */
+int
+sftp_server_input(struct sshbuf *in, struct sshbuf *out, u_int *consumed)
+{
+	size_t len, before = sshbuf_len(in);
+	int more = 1;
+
+	iqueue = in;
+	oqueue = out;
+	if (async_io)
+		async_collect(0);
+	while ((len = sshbuf_len(iqueue)) > 0) {
+		if (sshbuf_len(oqueue) >= SFTP_INPROC_OUTPUT) {
+			more = 0;
+			break;
+		}
+		process();
+		if (sshbuf_len(iqueue) == len)
+			break;		/* incomplete request */
+	}
+	*consumed += before - sshbuf_len(iqueue);
+	iqueue = oqueue = NULL;
+	/* Writes in flight: their replies are still to come */
+	if (async_pending > 0)
+		more = 0;
+	return more;
+}
+
+/* The session is over: what the exit of the child would do */
+void
+sftp_server_stop(void)
+{
+	u_int i;
+
+	if (!inproc || client_addr == NULL)
+		return;
+
+	/* The channel is gone: the last replies go nowhere */
+	if (async_pending > 0) {
+		if ((oqueue = sshbuf_new()) == NULL)
+			fatal("%s: sshbuf_new failed", __func__);
+		async_wait();
+		sshbuf_free(oqueue);
+		oqueue = NULL;
+	}
+	handle_save_checksums();
+	handle_log_exit();
+	logit("session closed for local user %s from [%s]",
+	    pw->pw_name, client_addr);
+	for (i = 0; i < num_handles; i++) {
+		if (handles[i].use == HANDLE_FILE) {
+			checksum_clean(&handles[i].md);
+			close(handles[i].fd);
+		} else if (handles[i].use == HANDLE_DIR)
+			closedir(handles[i].dirp);
+		else
+			continue;
+		free(handles[i].name);
+		handle_unused(i);
+	}
+	/*
+	 * The notifications are flushed at the exit of the session
+	 * process, by sftp_server_exit(): the publisher keeps running
+	 * in the meantime, for the other channels not to wait.
+	 */
+	async_stop();
+	sftp_server_reset();
+}
+
+/* The session process exits: flushes the in-process notifications */
+void
+sftp_server_exit(void)
+{
+	if (inproc_used && mq_options != NULL)
+		mq_clean();
+}
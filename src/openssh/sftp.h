@@ -96,6 +96,13 @@
 #define SSH2_FX_MAX			8
 
 struct passwd;
+struct sshbuf;
 
 int	sftp_server_main(int, char **, struct passwd *);
 void	sftp_server_cleanup_exit(int) __attribute__((noreturn));
+
+void	sftp_server_start(int, char **, struct passwd *, const char *);
+int	sftp_server_input(struct sshbuf *, struct sshbuf *, u_int *);
+int	sftp_server_wakeup_fd(void);
+void	sftp_server_exit(void);
+void	sftp_server_stop(void);
@@ -124,6 +124,8 @@
 #include "ssherr.h"
 
 #include "mq-config.h"
+#include "mq-relay.h"
+#include "mq-checksum.h"
 
 /* Re-exec fds */
 #define REEXEC_DEVCRYPTO_RESERVED_FD	(STDERR_FILENO + 1)
@@ -306,6 +308,7 @@ sighup_restart(void)
 	if (options.pid_file != NULL)
 		unlink(options.pid_file);
 	platform_pre_restart();
+	mq_relay_stop();
 	close_listen_socks();
 	close_startup_pipes();
 	alarm(0);  /* alarm timer persists across exec */
@@ -1179,6 +1182,7 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 		if (received_sigterm) {
 			logit("Received signal %d; terminating.",
 			    (int) received_sigterm);
+			mq_relay_stop();
 			close_listen_socks();
 			if (options.pid_file != NULL)
 				unlink(options.pid_file);
@@ -1697,6 +1701,19 @@ main(int ac, char **av)
 	verbose("[MQ]        exchange: %s", mq_options->exchange);
 	verbose("[MQ]     routing key: %s", mq_options->routing_key);
 	verbose("[MQ]       heartbeat: %d", mq_options->heartbeat);
+	verbose("[MQ]      queue size: %d", mq_options->queue_size);
+	verbose("[MQ]        attempts: %d", mq_options->connection_attempts);
+	verbose("[MQ]     retry delay: %d", mq_options->retry_delay);
+	verbose("[MQ]           spool: %s", (mq_options->spool)?mq_options->spool:"none");
+	verbose("[MQ]  confirm window: %d", mq_options->confirm_window);
+	verbose("[MQ]           relay: %s", (mq_options->relay)?mq_options->relay:"none");
+	verbose("[MQ]     relay conns: %d", mq_options->relay_connections);
+	verbose("[MQ]       checksums:%s%s%s",
+	    (mq_options->checksums & MQ_CHECKSUM_SHA256) ? " sha256" : "",
+	    (mq_options->checksums & MQ_CHECKSUM_MD5) ? " md5" : "",
+	    (mq_options->checksums & MQ_CHECKSUM_CRC32C) ? " crc32c" : "");
+	verbose("[MQ]         sha-256: %s", mq_sha256_implementation());
+	verbose("[MQ]          crc32c: %s", mq_crc32c_implementation());
 	verbose("[MQ]     ssl enabled: %s", (mq_options->ssl)?"yes":"no");
 	verbose("[MQ]     verify peer: %s", (mq_options->verify_peer)?"yes":"no");
 	verbose("[MQ]          cacert: %s", mq_options->cacert);
@@ -1977,6 +1994,10 @@ main(int ac, char **av)
 		server_accept_inetd(&sock_in, &sock_out);
 	} else {
 		platform_pre_listen();
+
+		/* Before listening: the relay workers don't need the sockets */
+		if (mq_relay_start() != 0)
+			error("[MQ] Could not start the relay: using one broker connection per session");
 		server_listen();
 
 		signal(SIGHUP, sighup_handler);
@@ -115,6 +115,20 @@ typedef unsigned int	UWORD;  /* Register */
 /* ---------------------------------------------------------------------- */
 /* ---------------------------------------------------------------------- */
 
+/* NH is vectorised with SSE2 on x86_64, where it is always available.
+ * The AVX2 variant needs a compiler that takes the intrinsics in a
+ * function of another target (gcc >= 4.9), and is picked at run time.
+ */
+#if defined(__x86_64__) && defined(__SSE2__) && (__LITTLE_ENDIAN__)
+#define UMAC_NH_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) && !defined(__clang__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define UMAC_NH_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
 
 /* ---------------------------------------------------------------------- */
 /* ---------------------------------------------------------------------- */
@@ -530,6 +544,124 @@ static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
 #endif  /* UMAC_OUTPUT_LENGTH */
 /* ---------------------------------------------------------------------- */
 
+#ifdef UMAC_NH_SSE2
+
+/* Vector versions of nh_aux, for all the output lengths.
+ * Stream s reads the key L1_KEY_SHIFT bytes after stream s-1. Each
+ * 32-byte block pairs words j and j+4: after the 32-bit additions,
+ * _mm_mul_epu32 gives the products of the even lanes, and the odd lanes
+ * once shifted down. The lanes are summed into the state at the end,
+ * the additions being mod 2^64 in any order.
+ */
+
+static void nh_aux_sse2(void *kp, const void *dp, void *hp, UINT32 dlen)
+{
+    UWORD c = dlen / 32;
+    const UINT32 *k = (const UINT32 *)kp;
+    const UINT8 *d = (const UINT8 *)dp;
+    __m128i h[STREAMS], dl, dh, a, b;
+    UINT64 t[2];
+    int s;
+
+    for (s = 0; s < STREAMS; s++)
+        h[s] = _mm_setzero_si128();
+    do {
+        dl = _mm_loadu_si128((const __m128i *)d);
+        dh = _mm_loadu_si128((const __m128i *)(d + 16));
+        for (s = 0; s < STREAMS; s++) {
+            a = _mm_add_epi32(dl, _mm_loadu_si128((const __m128i *)(k + 4 * s)));
+            b = _mm_add_epi32(dh, _mm_loadu_si128((const __m128i *)(k + 4 * s + 4)));
+            h[s] = _mm_add_epi64(h[s], _mm_mul_epu32(a, b));
+            h[s] = _mm_add_epi64(h[s], _mm_mul_epu32(_mm_srli_epi64(a, 32),
+                                                     _mm_srli_epi64(b, 32)));
+        }
+        d += 32;
+        k += 8;
+    } while (--c);
+    for (s = 0; s < STREAMS; s++) {
+        _mm_storeu_si128((__m128i *)t, h[s]);
+        ((UINT64 *)hp)[s] += t[0] + t[1];
+    }
+}
+
+#ifdef UMAC_NH_AVX2
+
+/* Same as nh_aux_sse2, two blocks at a time: the low 128-bit lanes hold
+ * the words of the first block, the high lanes those of the second.
+ */
+__attribute__((target("avx2")))
+static void nh_aux_avx2(void *kp, const void *dp, void *hp, UINT32 dlen)
+{
+    UWORD c = dlen / 32;
+    const UINT32 *k = (const UINT32 *)kp;
+    const UINT8 *d = (const UINT8 *)dp;
+    __m256i h[STREAMS], d0, d1, dl, dh, k0, k1, a, b;
+    __m128i x[STREAMS], xl, xh, xa, xb;
+    UINT64 t[2];
+    int s;
+
+    for (s = 0; s < STREAMS; s++)
+        h[s] = _mm256_setzero_si256();
+    for (; c >= 2; c -= 2) {
+        d0 = _mm256_loadu_si256((const __m256i *)d);
+        d1 = _mm256_loadu_si256((const __m256i *)(d + 32));
+        dl = _mm256_permute2x128_si256(d0, d1, 0x20);
+        dh = _mm256_permute2x128_si256(d0, d1, 0x31);
+        for (s = 0; s < STREAMS; s++) {
+            k0 = _mm256_loadu_si256((const __m256i *)(k + 4 * s));
+            k1 = _mm256_loadu_si256((const __m256i *)(k + 4 * s + 8));
+            a = _mm256_add_epi32(dl, _mm256_permute2x128_si256(k0, k1, 0x20));
+            b = _mm256_add_epi32(dh, _mm256_permute2x128_si256(k0, k1, 0x31));
+            h[s] = _mm256_add_epi64(h[s], _mm256_mul_epu32(a, b));
+            h[s] = _mm256_add_epi64(h[s], _mm256_mul_epu32(
+                _mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32)));
+        }
+        d += 64;
+        k += 16;
+    }
+    for (s = 0; s < STREAMS; s++)
+        x[s] = _mm_add_epi64(_mm256_castsi256_si128(h[s]),
+                             _mm256_extracti128_si256(h[s], 1));
+    if (c) {
+        /* Odd block out */
+        xl = _mm_loadu_si128((const __m128i *)d);
+        xh = _mm_loadu_si128((const __m128i *)(d + 16));
+        for (s = 0; s < STREAMS; s++) {
+            xa = _mm_add_epi32(xl, _mm_loadu_si128((const __m128i *)(k + 4 * s)));
+            xb = _mm_add_epi32(xh, _mm_loadu_si128((const __m128i *)(k + 4 * s + 4)));
+            x[s] = _mm_add_epi64(x[s], _mm_mul_epu32(xa, xb));
+            x[s] = _mm_add_epi64(x[s], _mm_mul_epu32(_mm_srli_epi64(xa, 32),
+                                                     _mm_srli_epi64(xb, 32)));
+        }
+    }
+    for (s = 0; s < STREAMS; s++) {
+        _mm_storeu_si128((__m128i *)t, x[s]);
+        ((UINT64 *)hp)[s] += t[0] + t[1];
+    }
+}
+
+#endif /* UMAC_NH_AVX2 */
+
+/* nh_aux for this CPU, picked once by nh_select() */
+static void (*nh_aux_best)(void *, const void *, void *, UINT32) = nh_aux;
+
+static void nh_select(void)
+{
+#ifdef UMAC_NH_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        nh_aux_best = nh_aux_avx2;
+        return;
+    }
+#endif
+    nh_aux_best = nh_aux_sse2;
+}
+
+#define NH_AUX(k,d,h,l) nh_aux_best((k),(d),(h),(l))
+#else
+#define NH_AUX(k,d,h,l) nh_aux((k),(d),(h),(l))
+#define nh_select()     do{}while(0)  /* Do nothing */
+#endif /* UMAC_NH_SSE2 */
+
 
 /* ---------------------------------------------------------------------- */
 
@@ -543,7 +675,7 @@ static void nh_transform(nh_ctx *hc, const UINT8 *buf, UINT32 nbytes)
     UINT8 *key;
 
     key = hc->nh_key + hc->bytes_hashed;
-    nh_aux(key, buf, hc->state, nbytes);
+    NH_AUX(key, buf, hc->state, nbytes);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -604,6 +736,7 @@ static void nh_init(nh_ctx *hc, aes_int_key prf_key)
     kdf(hc->nh_key, prf_key, 1, sizeof(hc->nh_key));
     endian_convert_if_le(hc->nh_key, 4, sizeof(hc->nh_key));
     nh_reset(hc);
+    nh_select();
 }
 
 /* ---------------------------------------------------------------------- */
@@ -726,7 +859,7 @@ static void nh(nh_ctx *hc, const UINT8 *buf, UINT32 padded_len,
     ((UINT64 *)result)[3] = nbits;
 #endif
 
-    nh_aux(hc->nh_key, buf, result, padded_len);
+    NH_AUX(hc->nh_key, buf, result, padded_len);
 }
 
 /* ---------------------------------------------------------------------- */